@@ -60,10 +60,23 @@ enum caml_ba_managed {
   CAML_BA_MANAGED_MASK = 0x600 /* Mask for "managed" bits in flags field */
 };
 
+#if defined(__FreeBSD__) && defined(_KERNEL)
+/* Data owned by the kernel, released through the proxy */
+enum caml_ba_fbsd {
+  CAML_BA_FBSD_IOPAGE = 0x800, /* Data is an io-page */
+  CAML_BA_FBSD_MBUF = 0x1000,  /* Data is (part of) an mbuf chain */
+  CAML_BA_FBSD_MASK = 0x1800   /* Mask for kFreeBSD bits in flags field */
+};
+#endif
+
 struct caml_ba_proxy {
   intnat refcount;              /* Reference count */
   void * data;                  /* Pointer to base of actual data */
   uintnat size;                 /* Size of data in bytes (if mapped file) */
+#if defined(__FreeBSD__) && defined(_KERNEL)
+  /* Frees data and the proxy once refcount drops to zero */
+  void (*release)(struct caml_ba_proxy *);
+#endif
 };
 
 struct caml_ba_array {
@@ -101,5 +114,10 @@ CAMLBAextern value
 CAMLBAextern value caml_ba_alloc_dims(int flags, int num_dims, void * data,
                                  ... /*dimensions, with type intnat */);
 CAMLBAextern uintnat caml_ba_byte_size(struct caml_ba_array * b);
+#if defined(__FreeBSD__) && defined(_KERNEL)
+CAMLBAextern value caml_ba_alloc_fbsd(int flags, intnat dim, mlsize_t max);
+CAMLBAextern void caml_ba_fbsd_attach(value v, struct caml_ba_proxy * proxy,
+                                      void * data);
+#endif
 
 #endif
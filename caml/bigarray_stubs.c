@@ -23,6 +23,10 @@
 #include "memory.h"
 #include "mlvalues.h"
 
+#if defined(__FreeBSD__) && defined(_KERNEL)
+#include <machine/atomic.h>
+#endif
+
 #define int8 caml_ba_int8
 #define uint8 caml_ba_uint8
 #define int16 caml_ba_int16
@@ -169,6 +173,45 @@ caml_ba_alloc(int flags, int num_dims, void * data, intnat * dim)
   return res;
 }
 
+#if defined(__FreeBSD__) && defined(_KERNEL)
+/* [caml_ba_alloc_fbsd] allocates a one-dimensional big array of [dim]
+   elements of kernel-owned data, [flags] including one of the
+   CAML_BA_FBSD_* bits.  The size of the data counts towards speeding up
+   the major GC, relative to [max].  The array maps nothing until
+   [caml_ba_fbsd_attach] gives it its data, so the caller may allocate it
+   before taking the data, and has nothing to release if this raises. */
+CAMLexport value
+caml_ba_alloc_fbsd(int flags, intnat dim, mlsize_t max)
+{
+  uintnat size;
+  value res;
+  struct caml_ba_array * b;
+
+  Assert(flags & CAML_BA_FBSD_MASK);
+  size = dim * caml_ba_element_size[flags & CAML_BA_KIND_MASK];
+  res = caml_alloc_custom(&caml_ba_ops, SIZEOF_BA_ARRAY + sizeof(intnat),
+                          size, max);
+  b = Caml_ba_array_val(res);
+  b->data = NULL;
+  b->num_dims = 1;
+  b->flags = flags;
+  b->proxy = NULL;
+  b->dim[0] = dim;
+  return res;
+}
+
+/* Map [data] in the array, which takes over one reference to [proxy]. */
+CAMLexport void
+caml_ba_fbsd_attach(value v, struct caml_ba_proxy * proxy, void * data)
+{
+  struct caml_ba_array * b = Caml_ba_array_val(v);
+
+  Assert(b->proxy == NULL);
+  b->data = data;
+  b->proxy = proxy;
+}
+#endif
+
 /* Same as caml_ba_alloc, but dimensions are passed as a list of
    arguments */
 
@@ -673,6 +716,16 @@ static void caml_ba_finalize(value v)
 {
   struct caml_ba_array * b = Caml_ba_array_val(v);
 
+#if defined(__FreeBSD__) && defined(_KERNEL)
+  /* The kernel may hold references to the same proxy from other threads. */
+  if (b->flags & CAML_BA_FBSD_MASK) {
+    if (b->proxy != NULL &&
+        atomic_fetchadd_long((volatile u_long *) &b->proxy->refcount, -1) == 1)
+      b->proxy->release(b->proxy);
+    return;
+  }
+#endif
+
   switch (b->flags & CAML_BA_MANAGED_MASK) {
   case CAML_BA_EXTERNAL:
     break;
@@ -1037,6 +1090,14 @@ static void caml_ba_update_proxy(struct caml_ba_array * b1,
                                  struct caml_ba_array * b2)
 {
   struct caml_ba_proxy * proxy;
+#if defined(__FreeBSD__) && defined(_KERNEL)
+  /* Kernel-owned arrays always come with a proxy */
+  if (b1->flags & CAML_BA_FBSD_MASK) {
+    b2->proxy = b1->proxy;
+    atomic_add_long((volatile u_long *) &b1->proxy->refcount, 1);
+    return;
+  }
+#endif
   /* Nothing to do for un-managed arrays */
   if ((b1->flags & CAML_BA_MANAGED_MASK) == CAML_BA_EXTERNAL) return;
   if (b1->proxy != NULL) {
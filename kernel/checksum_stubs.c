@@ -28,6 +28,15 @@
 
 CAMLprim value caml_ones_complement_checksum(value v_cstruct);
 CAMLprim value caml_ones_complement_checksum_list(value v_cstruct_list);
+CAMLprim value caml_ones_complement_checksum_update16(value v_csum, value v_old, value v_new);
+CAMLprim value caml_ones_complement_checksum_update32(value v_csum, value v_old, value v_new);
+CAMLprim value caml_ones_complement_checksum_update_cstruct(value v_csum, value v_old, value v_new);
+CAMLprim value caml_ones_complement_checksum_copy(value v_src, value v_dst, value v_pos, value v_sum);
+CAMLprim value caml_ones_complement_checksum_copy_string(value v_src, value v_srcofs, value v_dst, value v_pos, value v_sum);
+CAMLprim value caml_ones_complement_checksum_partial(value v_cstruct, value v_pos, value v_sum);
+CAMLprim value caml_ones_complement_checksum_pseudo_ipv4(value v_src, value v_dst, value v_proto, value v_len);
+CAMLprim value caml_ones_complement_checksum_combine(value v_sum1, value v_sum2);
+CAMLprim value caml_ones_complement_checksum_finish(value v_sum);
 
 #if !defined(__FreeBSD__) && defined(_KERNEL)
 /* WARNING: This code assumes that it is running on a little endian machine (x86) */
@@ -44,36 +53,78 @@ ntohs(uint16_t v)
 }
 #endif
 
-static uint16_t
-ones_complement_checksum_bigarray(unsigned char *addr, size_t ofs, size_t count, uint64_t sum64)
+/*
+ * The sum is accumulated as the native-order sum of 32-bit words in a
+ * 64-bit integer, with the carries folded back only at the end.  As the
+ * ones complement sum is the same whatever the word size or the order of
+ * the additions, this yields the same bits as a 16-bit sum.  Several
+ * independent accumulators keep the adds from waiting on each other, and
+ * 2^32 words fit in each before it could overflow.
+ */
+/* Ones complement addition of two 64-bit partial sums. */
+static inline uint64_t
+csum_add64(uint64_t sum, uint64_t v)
+{
+  sum += v;
+  if (sum < v) sum++;
+  return sum;
+}
+
+static inline uint16_t
+csum_fold(uint64_t sum64)
+{
+  while (sum64 >> 16)
+    sum64 = (sum64 & 0xffff) + (sum64 >> 16);
+  return htons(~sum64);
+}
+
+/* Add count bytes at addr to sum64, a trailing odd byte is padded with zero. */
+static uint64_t
+csum_add(const unsigned char *addr, size_t count, uint64_t sum64)
 {
-  addr += ofs;
-  uint64_t *data64 = (uint64_t *) addr;
-  while (count >= 8) {
-    uint64_t s = *data64++;
-    sum64 += s;
-    if (sum64 < s) sum64++;
-    count -= 8;
+  const uint32_t *data32;
+  uint64_t a0 = 0, a1 = 0, a2 = 0, a3 = 0;
+
+  while (count >= 32) {
+    data32 = (const uint32_t *) addr;
+    a0 += data32[0];
+    a1 += data32[1];
+    a2 += data32[2];
+    a3 += data32[3];
+    a0 += data32[4];
+    a1 += data32[5];
+    a2 += data32[6];
+    a3 += data32[7];
+    addr += 32;
+    count -= 32;
   }
 
-  addr = (unsigned char *) data64;
-  while (count > 1) {
-    uint16_t v = *((uint16_t *) addr);
-    sum64 += v;
-    if (sum64 < v) sum64++;
-    count -= 2;
-    addr += 2;
+  while (count >= 4) {
+    a0 += *((const uint32_t *) addr);
+    addr += 4;
+    count -= 4;
   }
 
-  if (count > 0) {
-    uint16_t v = ntohs((*addr) << 8);
-    sum64 += v;
-    if (sum64 < v) sum64++;
+  if (count > 1) {
+    a1 += *((const uint16_t *) addr);
+    addr += 2;
+    count -= 2;
   }
 
-  while (sum64 >> 16)
-    sum64 = (sum64 & 0xffff) + (sum64 >> 16);
-  return htons(~sum64);
+  if (count > 0)
+    a2 += ntohs((*addr) << 8);
+
+  sum64 = csum_add64(sum64, a0);
+  sum64 = csum_add64(sum64, a1);
+  sum64 = csum_add64(sum64, a2);
+  sum64 = csum_add64(sum64, a3);
+  return sum64;
+}
+
+static uint16_t
+ones_complement_checksum_bigarray(unsigned char *addr, size_t ofs, size_t count, uint64_t sum64)
+{
+  return csum_fold(csum_add(addr + ofs, count, sum64));
 }
 
 CAMLprim value
@@ -104,9 +155,7 @@ caml_ones_complement_checksum_list(value v_cstruct_list)
   size_t count = 0;
   struct caml_ba_array *a = NULL;
   unsigned char *addr;
-  uint64_t *data64;
   uint64_t sum64 = 0;
-  const size_t sizeof_ll = 8; /* sizeof (uint64_t) */
   while (v_cstruct_list != Val_emptylist) {
     v_hd = Field(v_cstruct_list, 0);
     v_cstruct_list = Field(v_cstruct_list, 1);
@@ -114,140 +163,277 @@ caml_ones_complement_checksum_list(value v_cstruct_list)
     v_ofs = Field(v_hd, 1);
     v_len = Field(v_hd, 2);
     a = Caml_ba_array_val(v_ba);
-    addr = (char *) a->data + Int_val(v_ofs);
+    addr = (unsigned char *) a->data + Int_val(v_ofs);
     count = Int_val(v_len);
     if (count <= 0) continue;
     if (overflow != 0) {
       overflow_val = ntohs((overflow_val << 8) + (*addr));
-      sum64 += overflow_val;
-      if (sum64 < overflow_val) sum64++;
+      sum64 = csum_add64(sum64, overflow_val);
       overflow = 0;
       addr++;
       count--;
     }
 
-    data64 = (uint64_t *) addr;
-
-#define checksum_DO_PARTIAL_LOOP_UNROLL
-#ifdef checksum_DO_PARTIAL_LOOP_UNROLL
-    while (count >= (20 * sizeof_ll)) {
-      uint64_t s;
-
-      s = *data64++;
-      sum64 += s;
-      if (sum64 < s) sum64++;
-
-      s = *data64++;
-      sum64 += s;
-      if (sum64 < s) sum64++;
-
-      s = *data64++;
-      sum64 += s;
-      if (sum64 < s) sum64++;
-
-      s = *data64++;
-      sum64 += s;
-      if (sum64 < s) sum64++;
-
-      s = *data64++;
-      sum64 += s;
-      if (sum64 < s) sum64++;
+    sum64 = csum_add(addr, count & ~((size_t) 1), sum64);
 
-      s = *data64++;
-      sum64 += s;
-      if (sum64 < s) sum64++;
-
-      s = *data64++;
-      sum64 += s;
-      if (sum64 < s) sum64++;
+    if (count & 1) {
+      overflow_val = addr[count - 1];
+      overflow = 1;
+    }
+  }
 
-      s = *data64++;
-      sum64 += s;
-      if (sum64 < s) sum64++;
+  if (overflow != 0) {
+    overflow_val = ntohs(overflow_val << 8);
+    sum64 = csum_add64(sum64, overflow_val);
+  }
 
-      s = *data64++;
-      sum64 += s;
-      if (sum64 < s) sum64++;
+  checksum = csum_fold(sum64);
+  CAMLreturn(Val_int(checksum));
+}
 
-      s = *data64++;
-      sum64 += s;
-      if (sum64 < s) sum64++;
+/*
+ * Incremental updates (RFC 1624, eqn. 3): when a 16-bit word m of the
+ * checksummed data becomes m', the checksum HC becomes
+ * HC' = ~(~HC + ~m + m').  Checksums and fields are given as read from
+ * the packet in network byte order, so that rewriting an address, a port
+ * or the TTL of a header costs the same whatever the payload length.
+ */
+static inline uint16_t
+csum_update(uint16_t csum, uint64_t sum64)
+{
+  sum64 += (uint16_t) ~csum;
+  while (sum64 >> 16)
+    sum64 = (sum64 & 0xffff) + (sum64 >> 16);
+  return ~sum64;
+}
 
-      s = *data64++;
-      sum64 += s;
-      if (sum64 < s) sum64++;
+CAMLprim value
+caml_ones_complement_checksum_update16(value v_csum, value v_old, value v_new)
+{
+  CAMLparam3(v_csum, v_old, v_new);
+  uint64_t sum64;
+  sum64 = (uint16_t) ~Int_val(v_old);
+  sum64 += (uint16_t) Int_val(v_new);
+  CAMLreturn(Val_int(csum_update(Int_val(v_csum), sum64)));
+}
 
-      s = *data64++;
-      sum64 += s;
-      if (sum64 < s) sum64++;
+CAMLprim value
+caml_ones_complement_checksum_update32(value v_csum, value v_old, value v_new)
+{
+  CAMLparam3(v_csum, v_old, v_new);
+  uint32_t old32 = Long_val(v_old), new32 = Long_val(v_new);
+  uint64_t sum64;
+  sum64 = (uint16_t) ~(old32 >> 16);
+  sum64 += (uint16_t) ~old32;
+  sum64 += new32 >> 16;
+  sum64 += new32 & 0xffff;
+  CAMLreturn(Val_int(csum_update(Int_val(v_csum), sum64)));
+}
 
-      s = *data64++;
-      sum64 += s;
-      if (sum64 < s) sum64++;
+/* The bytes of cstruct v_old were replaced by those of v_new, which must
+ * have the same length and start at an even offset of the checksummed
+ * data.  v_old may be a copy kept aside before rewriting in place. */
+CAMLprim value
+caml_ones_complement_checksum_update_cstruct(value v_csum, value v_old, value v_new)
+{
+  CAMLparam3(v_csum, v_old, v_new);
+  uint64_t old64, new64;
+  size_t count;
+  count = Int_val(Field(v_new, 2));
+  if (Int_val(Field(v_old, 2)) != count)
+    caml_invalid_argument("ones_complement_checksum_update_cstruct");
+  old64 = csum_add((unsigned char *) Caml_ba_data_val(Field(v_old, 0)) + Int_val(Field(v_old, 1)), count, 0);
+  new64 = csum_add((unsigned char *) Caml_ba_data_val(Field(v_new, 0)) + Int_val(Field(v_new, 1)), count, 0);
+  /* csum_fold() yields the complement of the sum in network byte order. */
+  old64 = csum_fold(old64);
+  new64 = (uint16_t) ~csum_fold(new64);
+  CAMLreturn(Val_int(csum_update(Int_val(v_csum), old64 + new64)));
+}
 
-      s = *data64++;
-      sum64 += s;
-      if (sum64 < s) sum64++;
+/*
+ * Partial sums are the ones complement sums of some data read as 16-bit
+ * words in network byte order, not yet complemented and with the carries
+ * folded into 32 bits, so they fit an OCaml int.  The sum of data starting
+ * at an odd offset of the checksummed data is the byte swap of the sum it
+ * would have at an even one.
+ */
+static inline uint32_t
+csum_fold32(uint64_t sum64)
+{
+  sum64 = (sum64 & 0xffffffff) + (sum64 >> 32);
+  sum64 = (sum64 & 0xffffffff) + (sum64 >> 32);
+  return sum64;
+}
 
-      s = *data64++;
-      sum64 += s;
-      if (sum64 < s) sum64++;
+/* Partial sum of the native sum64 of data starting at offset pos. */
+static uint32_t
+csum_partial(uint64_t sum64, size_t pos)
+{
+  uint16_t sum16;
+  sum16 = ~csum_fold(sum64);
+  if (pos & 1)
+    sum16 = (sum16 << 8) | (sum16 >> 8);
+  return sum16;
+}
 
-      s = *data64++;
-      sum64 += s;
-      if (sum64 < s) sum64++;
+/* Copy count bytes from src to dst, which must not overlap, and add them to
+ * sum64 on the way, as csum_add() does. */
+static uint64_t
+csum_copy(unsigned char *dst, const unsigned char *src, size_t count, uint64_t sum64)
+{
+  const uint32_t *src32;
+  uint32_t *dst32;
+  uint32_t w0, w1, w2, w3;
+  uint64_t a0 = 0, a1 = 0, a2 = 0, a3 = 0;
+
+  while (count >= 16) {
+    src32 = (const uint32_t *) src;
+    dst32 = (uint32_t *) dst;
+    w0 = src32[0];
+    w1 = src32[1];
+    w2 = src32[2];
+    w3 = src32[3];
+    dst32[0] = w0;
+    dst32[1] = w1;
+    dst32[2] = w2;
+    dst32[3] = w3;
+    a0 += w0;
+    a1 += w1;
+    a2 += w2;
+    a3 += w3;
+    src += 16;
+    dst += 16;
+    count -= 16;
+  }
 
-      s = *data64++;
-      sum64 += s;
-      if (sum64 < s) sum64++;
+  while (count >= 4) {
+    w0 = *((const uint32_t *) src);
+    *((uint32_t *) dst) = w0;
+    a0 += w0;
+    src += 4;
+    dst += 4;
+    count -= 4;
+  }
 
-      s = *data64++;
-      sum64 += s;
-      if (sum64 < s) sum64++;
+  if (count > 1) {
+    w1 = *((const uint16_t *) src);
+    *((uint16_t *) dst) = w1;
+    a1 += w1;
+    src += 2;
+    dst += 2;
+    count -= 2;
+  }
 
-      s = *data64++;
-      sum64 += s;
-      if (sum64 < s) sum64++;
+  if (count > 0) {
+    *dst = *src;
+    a2 += ntohs((*src) << 8);
+  }
 
-      s = *data64++;
-      sum64 += s;
-      if (sum64 < s) sum64++;
+  sum64 = csum_add64(sum64, a0);
+  sum64 = csum_add64(sum64, a1);
+  sum64 = csum_add64(sum64, a2);
+  sum64 = csum_add64(sum64, a3);
+  return sum64;
+}
 
-      count -= (20 * sizeof_ll);
-    }
-#endif
+/*
+ * Copy cstruct v_src to the start of cstruct v_dst, and return the partial
+ * sum v_sum plus that of the copied data, which is at offset v_pos of the
+ * checksummed data.  Fragments are chained by passing the returned sum and
+ * the number of bytes copied so far, odd lengths included.
+ */
+CAMLprim value
+caml_ones_complement_checksum_copy(value v_src, value v_dst, value v_pos, value v_sum)
+{
+  CAMLparam4(v_src, v_dst, v_pos, v_sum);
+  uint64_t sum64;
+  size_t count;
+  count = Long_val(Field(v_src, 2));
+  if (Long_val(Field(v_dst, 2)) < count)
+    caml_invalid_argument("ones_complement_checksum_copy");
+  sum64 = csum_copy(
+    (unsigned char *) Caml_ba_data_val(Field(v_dst, 0)) + Long_val(Field(v_dst, 1)),
+    (unsigned char *) Caml_ba_data_val(Field(v_src, 0)) + Long_val(Field(v_src, 1)),
+    count, 0);
+  sum64 = csum_partial(sum64, Long_val(v_pos)) + (uint64_t) Long_val(v_sum);
+  CAMLreturn(Val_long(csum_fold32(sum64)));
+}
 
-    while (count >= sizeof_ll)	{
-      uint64_t s = *data64++;
-      sum64 += s;
-      if (sum64 < s) sum64++;
-      count -= sizeof_ll;
-    }
+/* Same as caml_ones_complement_checksum_copy(), but fill cstruct v_dst from
+ * string v_src at offset v_srcofs. */
+CAMLprim value
+caml_ones_complement_checksum_copy_string(value v_src, value v_srcofs, value v_dst, value v_pos, value v_sum)
+{
+  CAMLparam5(v_src, v_srcofs, v_dst, v_pos, v_sum);
+  uint64_t sum64;
+  size_t count;
+  long srcofs;
+  count = Long_val(Field(v_dst, 2));
+  srcofs = Long_val(v_srcofs);
+  if (srcofs < 0 || srcofs + count > caml_string_length(v_src))
+    caml_invalid_argument("ones_complement_checksum_copy_string");
+  sum64 = csum_copy(
+    (unsigned char *) Caml_ba_data_val(Field(v_dst, 0)) + Long_val(Field(v_dst, 1)),
+    (const unsigned char *) String_val(v_src) + srcofs,
+    count, 0);
+  sum64 = csum_partial(sum64, Long_val(v_pos)) + (uint64_t) Long_val(v_sum);
+  CAMLreturn(Val_long(csum_fold32(sum64)));
+}
 
-    addr = (unsigned char *) data64;
-    while (count > 1) {
-      uint16_t v = *((uint16_t *) addr);
-      sum64 += v;
-      if (sum64 < v) sum64++;
-      count -= 2;
-      addr += 2;
-    }
+/*
+ * Partial sums can be computed piecewise and combined, so that the
+ * checksum of a TCP or UDP segment needs neither a pseudo-header buffer
+ * nor a list of Cstructs:
+ *
+ *   finish (partial payload hlen (partial hdr 0 (pseudo_ipv4 src dst 6 len)))
+ */
 
-    if (count > 0) {
-      overflow_val = *addr;
-      overflow = 1;
-    }
+/* Partial sum v_sum plus that of cstruct v_cstruct, which is at offset
+ * v_pos of the checksummed data. */
+CAMLprim value
+caml_ones_complement_checksum_partial(value v_cstruct, value v_pos, value v_sum)
+{
+  CAMLparam3(v_cstruct, v_pos, v_sum);
+  uint64_t sum64;
+  sum64 = csum_add(
+    (unsigned char *) Caml_ba_data_val(Field(v_cstruct, 0)) + Long_val(Field(v_cstruct, 1)),
+    Long_val(Field(v_cstruct, 2)), 0);
+  sum64 = csum_partial(sum64, Long_val(v_pos)) + (uint64_t) Long_val(v_sum);
+  CAMLreturn(Val_long(csum_fold32(sum64)));
+}
 
-  }
+/* Partial sum of the IPv4 pseudo-header, the addresses are given as
+ * integers in host byte order. */
+CAMLprim value
+caml_ones_complement_checksum_pseudo_ipv4(value v_src, value v_dst, value v_proto, value v_len)
+{
+  CAMLparam4(v_src, v_dst, v_proto, v_len);
+  uint32_t src = Long_val(v_src), dst = Long_val(v_dst);
+  uint64_t sum64;
+  sum64 = (src >> 16) + (src & 0xffff);
+  sum64 += (dst >> 16) + (dst & 0xffff);
+  sum64 += (uint8_t) Long_val(v_proto);
+  sum64 += (uint16_t) Long_val(v_len);
+  CAMLreturn(Val_long(csum_fold32(sum64)));
+}
 
-  if (overflow != 0) {
-    overflow_val = ntohs(overflow_val << 8);
-    sum64 += overflow_val;
-    if (sum64 < overflow_val) sum64++;
-  }
+CAMLprim value
+caml_ones_complement_checksum_combine(value v_sum1, value v_sum2)
+{
+  CAMLparam2(v_sum1, v_sum2);
+  uint64_t sum64;
+  sum64 = (uint64_t) Long_val(v_sum1) + (uint64_t) Long_val(v_sum2);
+  CAMLreturn(Val_long(csum_fold32(sum64)));
+}
 
+/* The checksum to store in the packet, as caml_ones_complement_checksum()
+ * returns it. */
+CAMLprim value
+caml_ones_complement_checksum_finish(value v_sum)
+{
+  CAMLparam1(v_sum);
+  uint64_t sum64 = (uint64_t) Long_val(v_sum);
   while (sum64 >> 16)
     sum64 = (sum64 & 0xffff) + (sum64 >> 16);
-  checksum = htons(~sum64);
-  CAMLreturn(Val_int(checksum));
+  CAMLreturn(Val_int((uint16_t) ~sum64));
 }
@@ -42,7 +42,7 @@ kern_gettimeofday(value v_unit)
 
 	microtime(&atv);
 	return caml_copy_double(fixpt_add(fixpt_from_int(atv.tv_sec),
-	    fixpt_div(fixpt_from_int(atv.tv_usec), 10000000 * fixpt_one)));
+	    fixpt_div(fixpt_from_int(atv.tv_usec), 1000000 * fixpt_one)));
 }
 
 #define	SPD	(24 * 60 * 60)
@@ -37,15 +37,21 @@
 #include <sys/kernel.h>
 #include <sys/kthread.h>
 #include <sys/sched.h>
+#include <sys/smp.h>
 #include <sys/lock.h>
 #include <sys/mutex.h>
 #include <sys/systm.h>
 #include <sys/malloc.h>
 #include <sys/mbuf.h>
+#include <sys/sbuf.h>
+#include <sys/sysctl.h>
+#include <sys/time.h>
 #ifdef MEM_LEAK
 #include <sys/queue.h>
 #endif
 
+#include <machine/cpu.h>
+
 #include <vm/vm.h>
 #include <vm/pmap.h>
 #include <vm/vm_param.h>
@@ -70,7 +76,12 @@
 #include "caml/custom.h"
 #include "caml/finalise.h"
 
+#include <fixmath.h>
+
 CAMLprim value caml_block_kernel(value v_timeout);
+CAMLprim value caml_sched_probe(value v_phase);
+CAMLprim value caml_kthread_running(value v_unit);
+void mirage_kthread_wakeup(void);
 
 int atoi(const char *str) {
   return (int) strtol(str, (char**) NULL, 10);
@@ -94,20 +105,39 @@ enum allocation_type {
 	ALLOC_CONTIG
 };
 
+/* Aggregate counters of the allocations made at a given line. */
+struct allocation_site {
+	char *as_file;			/* NULL if the slot is free */
+	int as_line;
+	volatile u_long as_live;	/* Bytes still allocated */
+	volatile u_long as_allocs;
+	volatile u_long as_frees;
+};
+
 struct allocation_info {
-	TAILQ_ENTRY(allocation_info) ai_next;
-	char *ai_file;
-	int ai_line;
+	LIST_ENTRY(allocation_info) ai_next;
+	struct allocation_site *ai_site;
 	unsigned long ai_size;
 	void *ai_ptr;
 	enum allocation_type ai_type;
 	char *ai_comment;
 };
 
-static TAILQ_HEAD(allocations_head, allocation_info) aihead =
-    TAILQ_HEAD_INITIALIZER(aihead);
-
-static struct mtx aihead_lock;
+/*
+ * Live allocations are hashed by address, with a lock per group of
+ * buckets, so that tracking stays cheap enough to be left on under load.
+ * Sites are kept in an open-addressed table that only grows.
+ */
+#define AI_HASH_BITS	13
+#define AI_HASH_SIZE	(1 << AI_HASH_BITS)
+#define AI_LOCKS	64
+#define AI_SITES	1024
+
+static LIST_HEAD(, allocation_info) aihash[AI_HASH_SIZE];
+static struct mtx ailocks[AI_LOCKS];
+static struct allocation_site aisites[AI_SITES];
+static struct mtx aisite_lock;
+static uma_zone_t aizone;
 #endif
 
 enum thread_state {
@@ -121,9 +151,66 @@ static struct thread *mirage_kthread = NULL;
 static const long mirage_minmem = 32 << 20; /* Minimum limit: 32 MB */
 static long mirage_memlimit;
 
+/*
+ * Bytes currently allocated by the module, checked against
+ * mirage_memlimit.  Sizes are those of the malloc(9) buckets actually
+ * used, so that frees subtract exactly what allocations added.
+ */
+static volatile u_long mirage_memused;
+
+/*
+ * The Mirage kernel thread sleeps on block_pending in caml_block_kernel()
+ * until its timeout expires or somebody calls mirage_kthread_wakeup().
+ */
+static struct mtx block_lock;
+static volatile u_int block_pending;
+
+/*
+ * How late caml_block_kernel() returns after its timeout, in buckets of
+ * powers of two microseconds: bucket i counts overshoots below 2^i us.
+ * The first row is for timeouts rounded to ticks (debug.mirage_block_ticks
+ * set, as caml_block_kernel() used to sleep), the second for sbintime_t
+ * ones, so that both can be compared on the same machine.
+ */
+#define BLOCK_HIST_BUCKETS	24
+static u_long block_overshoot[2][BLOCK_HIST_BUCKETS];
+
+static int block_ticks;
+SYSCTL_INT(_debug, OID_AUTO, mirage_block_ticks, CTLFLAG_RW, &block_ticks, 0,
+    "Sleep for whole ticks in caml_block_kernel, as before");
+
+/*
+ * Cycles spent in each phase of the scheduler loop in OS.Main, in
+ * buckets of powers of two.  The order of the phases must match that of
+ * Main.phase.  Only the Mirage kernel thread updates them.
+ */
+enum sched_phase {
+	SCHED_LOOP,		/* between two iterations */
+	SCHED_WAKEUP_PAUSED,
+	SCHED_RESTART_THREADS,
+	SCHED_POLL,
+	SCHED_SELECT_NEXT,
+	SCHED_BLOCK_KERNEL,
+	SCHED_ACTIVATIONS,
+	SCHED_PHASES
+};
+
+#define SCHED_HIST_BUCKETS	48
+
+static const char *sched_phase_names[SCHED_PHASES] = {
+	"loop", "wakeup_paused", "restart_threads", "poll", "select_next",
+	"block_kernel", "activations"
+};
+
+static uint64_t sched_hist[SCHED_PHASES][SCHED_HIST_BUCKETS];
+static uint64_t sched_mark;
+
+/* What caml_block_kernel() ended up doing. */
+static u_long sched_nosleep, sched_woken, sched_timedout;
+
 int event_handler(struct module *module, int event, void *arg);
 
-static int allocated(void);
+static int mem_reserve(long size);
 static void mem_cleanup(void);
 
 #if 0
@@ -131,7 +218,11 @@ void netif_init(void);
 void netif_deinit(void);
 #endif
 
+void iopage_init(void);
+void iopage_deinit(void);
+
 int get_memlimit(void);
+static int get_cpu(void);
 char *get_rtparams(void);
 
 
@@ -139,7 +230,23 @@ static void
 mirage_kthread_body(void *arg __unused)
 {
 	value *v_f;
-	int caml_completed = 0;
+	int cpu;
+
+	/*
+	 * Keep the runtime, its heap and the per-CPU page caches on one
+	 * core if asked to.
+	 */
+	cpu = get_cpu();
+
+	if (cpu >= 0) {
+		if ((u_int) cpu <= mp_maxid && !CPU_ABSENT(cpu)) {
+			thread_lock(curthread);
+			sched_bind(curthread, cpu);
+			thread_unlock(curthread);
+		} else
+			printf("[%s] CPU %d is not available.\n", module_name,
+			    cpu);
+	}
 
 	mirage_kthread_state = THR_RUNNING;
 	caml_startup(argv);
@@ -151,8 +258,14 @@ mirage_kthread_body(void *arg __unused)
 		goto done;
 	}
 
-	for (; (caml_completed == 0) && (mirage_kthread_state == THR_RUNNING);) {
-		caml_completed = Bool_val(caml_callback(*v_f, Val_unit));
+	/*
+	 * OS.Main.run loops by itself until the program completes or
+	 * caml_kthread_running() tells it to stop.
+	 */
+	if (mirage_kthread_state == THR_RUNNING) {
+		/* Start the first phase of caml_sched_probe() from here. */
+		sched_mark = get_cyclecount();
+		caml_callback(*v_f, Val_unit);
 	}
 
 done:
@@ -169,6 +282,12 @@ done:
 	kthread_exit();
 }
 
+CAMLprim value
+caml_kthread_running(value v_unit __unused)
+{
+	return Val_bool(mirage_kthread_state == THR_RUNNING);
+}
+
 static int
 mirage_kthread_init(void)
 {
@@ -191,6 +310,7 @@ mirage_kthread_deinit(void)
 {
 	if (mirage_kthread_state == THR_RUNNING) {
 		mirage_kthread_state = THR_STOPPED;
+		mirage_kthread_wakeup();
 		tsleep((void *) &mirage_kthread_state, 0,
 		    "mirage_kthread_deinit", 0);
 		pause("mirage_kthread_deinit", 1);
@@ -212,8 +332,17 @@ mirage_kthread_launch(void)
 static void
 leakfinder_init(void)
 {
-	TAILQ_INIT(&aihead);
-	mtx_init(&aihead_lock, "aihead", NULL, MTX_DEF);
+	int i;
+
+	for (i = 0; i < AI_HASH_SIZE; i++)
+		LIST_INIT(&aihash[i]);
+
+	for (i = 0; i < AI_LOCKS; i++)
+		mtx_init(&ailocks[i], "aihash", NULL, MTX_DEF | MTX_DUPOK);
+
+	mtx_init(&aisite_lock, "aisite", NULL, MTX_DEF);
+	aizone = uma_zcreate("mirage_alloc", sizeof(struct allocation_info),
+	    NULL, NULL, NULL, NULL, UMA_ALIGN_PTR, 0);
 }
 #endif
 
@@ -242,6 +371,25 @@ get_memlimit(void)
 	return max(limit, mirage_minmem);
 }
 
+/* The CPU to bind the Mirage kernel thread to, or -1 for any. */
+static int
+get_cpu(void)
+{
+	char buf[256];
+	int cpu;
+
+	cpu = -1;
+	getenv_int("mirage.cpu", &cpu);
+
+	if (module_name != NULL) {
+		snprintf(buf, 255, "mirage.%s.cpu", module_name);
+		buf[255] = '\0';
+		getenv_int(buf, &cpu);
+	}
+
+	return cpu;
+}
+
 char *
 get_rtparams(void)
 {
@@ -279,6 +427,8 @@ event_handler(struct module *module, int event, void *arg) {
 		printf("[%s] Memory limit: %d MB\n", module_name,
 		    (int) (mirage_memlimit >> 20));
 		//netif_init();
+		iopage_init();
+		mtx_init(&block_lock, "caml_block_kernel", NULL, MTX_DEF);
 		mirage_kthread_init();
 		mirage_kthread_launch();
 		inited = 1;
@@ -291,7 +441,9 @@ event_handler(struct module *module, int event, void *arg) {
 			break;
 		}
 		retval = mirage_kthread_deinit();
+		mtx_destroy(&block_lock);
 		//netif_deinit();
+		iopage_deinit();
 		mem_cleanup();
 		break;
 	default:
@@ -302,53 +454,306 @@ event_handler(struct module *module, int event, void *arg) {
 	return retval;
 }
 
-static int block_timo;
+/*
+ * Timeouts are 48.16 fixed-point seconds and sbintime_t is 32.32, so the
+ * conversion is a shift.  Anything beyond the range of sbintime_t means
+ * waiting for a wakeup only.
+ */
+static sbintime_t
+block_sbt(fixpt timo)
+{
+	if (timo <= 0)
+		return 0;
+
+	if (timo >= (fixpt) INT32_MAX << FIXEDPT_FBITS)
+		return -1;
+
+	return (sbintime_t) timo << (32 - FIXEDPT_FBITS);
+}
 
 CAMLprim value
 caml_block_kernel(value v_timeout)
 {
 	CAMLparam1(v_timeout);
+	sbintime_t sbt, start, late;
+	int error, rounded, timo;
+
+	sbt = block_sbt(Double_val(v_timeout));
+	rounded = block_ticks != 0;
+
+	/*
+	 * Nothing to wait for: give up the CPU only if it has been held for
+	 * too long, instead of sleeping for a full tick.
+	 */
+	if (sbt == 0 && !rounded) {
+		sched_nosleep++;
+		block_pending = 0;
+		maybe_yield();
+		CAMLreturn(Val_unit);
+	}
+
+	/* The former behaviour: at least one tick, then whole ticks. */
+	timo = 0;
+	if (rounded && sbt >= 0)
+		timo = imax(1, lmin(INT_MAX, fixpt_to_int(fixpt_mul(
+		    Double_val(v_timeout), fixpt_from_int(hz)))));
+
+	error = 0;
+	start = sbinuptime();
+	mtx_lock(&block_lock);
+	if (block_pending == 0) {
+		if (rounded)
+			error = msleep(&block_pending, &block_lock, 0,
+			    "caml_block_kernel", timo);
+		else
+			error = msleep_sbt(&block_pending, &block_lock, 0,
+			    "caml_block_kernel", sbt > 0 ? sbt : 0, SBT_1US, 0);
+	}
+	block_pending = 0;
+	mtx_unlock(&block_lock);
+
+	if (error != EWOULDBLOCK)
+		sched_woken++;
+	else {
+		sched_timedout++;
+		late = sbinuptime() - start - sbt;
+		atomic_add_long(&block_overshoot[!rounded][min(late > 0 ?
+		    flsll(sbttous(late)) : 0, BLOCK_HIST_BUCKETS - 1)], 1);
+	}
 
-	block_timo = fixpt_to_int(fixpt_mul(Double_val(v_timeout),
-	    fixpt_from_int(hz)));
-	pause("caml_block_kernel", block_timo);
 	CAMLreturn(Val_unit);
 }
 
+/* sysctl debug.mirage_block_overshoot: the histogram above. */
 static int
-allocated(void)
+sysctl_mirage_block_overshoot(SYSCTL_HANDLER_ARGS)
 {
-	struct malloc_type_internal *mtip;
-	long alloced;
-	int i;
+	struct sbuf *sb;
+	int error, i;
+
+	sb = sbuf_new_for_sysctl(NULL, NULL, 1024, req);
+
+	if (sb == NULL)
+		return ENOMEM;
+
+	sbuf_printf(sb, "\n%10s %10s %10s\n", "< us", "ticks", "sbt");
 
-	mtip = M_MIRAGE->ks_handle;
-	alloced = 0;
-	for (i = 0; i < MAXCPU; i++)
-		alloced += mtip->mti_stats[i].mts_memalloced;
+	for (i = 0; i < BLOCK_HIST_BUCKETS; i++)
+		sbuf_printf(sb, "%10lu %10lu %10lu\n", 1UL << i,
+		    block_overshoot[0][i], block_overshoot[1][i]);
 
-	return alloced;
+	error = sbuf_finish(sb);
+	sbuf_delete(sb);
+	return error;
+}
+
+SYSCTL_PROC(_debug, OID_AUTO, mirage_block_overshoot,
+    CTLTYPE_STRING | CTLFLAG_RD, NULL, 0, sysctl_mirage_block_overshoot, "A",
+    "Mirage timer overshoot histogram");
+
+/*
+ * Account the cycles since the previous probe to the phase that has just
+ * ended.  This is called a few times per iteration of the scheduler
+ * loop, so it does not allocate and does not take locks.
+ */
+CAMLprim value
+caml_sched_probe(value v_phase)
+{
+	uint64_t now, delta;
+	int phase;
+
+	now = get_cyclecount();
+	delta = now - sched_mark;
+	sched_mark = now;
+	phase = Int_val(v_phase);
+
+	if (phase >= 0 && phase < SCHED_PHASES)
+		sched_hist[phase][min(flsll(delta), SCHED_HIST_BUCKETS - 1)]++;
+
+	return Val_unit;
+}
+
+/* sysctl debug.mirage_sched: the histograms and counters above. */
+static int
+sysctl_mirage_sched(SYSCTL_HANDLER_ARGS)
+{
+	struct sbuf *sb;
+	uint64_t n;
+	int error, i, j;
+
+	sb = sbuf_new_for_sysctl(NULL, NULL, 4096, req);
+
+	if (sb == NULL)
+		return ENOMEM;
+
+	sbuf_printf(sb, "\nblock_kernel: %lu without sleeping, %lu woken, "
+	    "%lu timed out\n", sched_nosleep, sched_woken, sched_timedout);
+	sbuf_printf(sb, "%-16s %12s %12s\n", "phase", "< cycles", "count");
+
+	for (i = 0; i < SCHED_PHASES; i++) {
+		for (j = 0; j < SCHED_HIST_BUCKETS; j++) {
+			n = sched_hist[i][j];
+
+			if (n == 0)
+				continue;
+
+			sbuf_printf(sb, "%-16s %12ju %12ju\n",
+			    sched_phase_names[i], (uintmax_t) 1 << j,
+			    (uintmax_t) n);
+		}
+	}
+
+	error = sbuf_finish(sb);
+	sbuf_delete(sb);
+	return error;
+}
+
+SYSCTL_PROC(_debug, OID_AUTO, mirage_sched, CTLTYPE_STRING | CTLFLAG_RD,
+    NULL, 0, sysctl_mirage_sched, "A", "Mirage scheduler loop histograms");
+
+/*
+ * Wake up the Mirage kernel thread if it is blocked, or make its next
+ * caml_block_kernel() return immediately.  The lock is only taken for
+ * the first event after the thread has last woken up, so this is cheap
+ * enough to be called for every received frame.
+ */
+void
+mirage_kthread_wakeup(void)
+{
+	if (atomic_cmpset_int(&block_pending, 0, 1)) {
+		mtx_lock(&block_lock);
+		wakeup(&block_pending);
+		mtx_unlock(&block_lock);
+	}
+}
+
+/*
+ * Account for size more bytes, or fail if that would exceed the limit.
+ * Callers settle the difference with the real size afterwards.
+ */
+static int
+mem_reserve(long size)
+{
+	if ((long) atomic_fetchadd_long(&mirage_memused, size) + size >
+	    mirage_memlimit) {
+		atomic_subtract_long(&mirage_memused, size);
+		return 0;
+	}
+
+	return 1;
+}
+
+static void
+mem_settle(long reserved, long used)
+{
+	atomic_add_long(&mirage_memused, used - reserved);
+}
+
+/* Size of the malloc(9) bucket holding addr. */
+static u_long
+malloc_size(void *addr)
+{
+	uma_slab_t slab;
+
+	if (addr == NULL)
+		return 0;
+
+	slab = vtoslab((vm_offset_t)addr & (~UMA_SLAB_MASK));
+
+	if (slab == NULL)
+		return 0;
+
+	return (!(slab->us_flags & UMA_SLAB_MALLOC)) ?
+	    slab->us_keg->uk_size : slab->us_size;
 }
 
 #ifdef MEM_LEAK
+static u_int
+ai_hash(void *addr)
+{
+	return (((uint64_t) (uintptr_t) addr >> 4) * 0x9e3779b97f4a7c15ull) >>
+	    (64 - AI_HASH_BITS);
+}
+
+static struct mtx *
+ai_lock(u_int bucket)
+{
+	return &ailocks[bucket & (AI_LOCKS - 1)];
+}
+
+/*
+ * The site of file:line, or NULL if the table is full.  Slots are only
+ * ever filled, each with its line before its file, so known sites are
+ * found without the lock; it is only taken to add a new one.
+ */
+static struct allocation_site *
+ai_site(char *file, int line)
+{
+	struct allocation_site *as;
+	char *f;
+	u_int h, i, n;
+
+	h = (((uintptr_t) file >> 3) ^ (line * 0x9e3779b1u)) & (AI_SITES - 1);
+
+	for (n = 0, i = h; n < AI_SITES; n++, i = (i + 1) & (AI_SITES - 1)) {
+		as = &aisites[i];
+		f = (char *) atomic_load_acq_ptr((volatile uintptr_t *)
+		    &as->as_file);
+
+		if (f == NULL)
+			break;
+
+		if (f == file && as->as_line == line)
+			return as;
+	}
+
+	if (n == AI_SITES)
+		return NULL;
+
+	/* Start over, as the site may have been added meanwhile. */
+	mtx_lock(&aisite_lock);
+	for (n = 0, i = h; n < AI_SITES; n++, i = (i + 1) & (AI_SITES - 1)) {
+		as = &aisites[i];
+
+		if (as->as_file == NULL) {
+			as->as_line = line;
+			atomic_store_rel_ptr((volatile uintptr_t *)
+			    &as->as_file, (uintptr_t) file);
+			break;
+		}
+
+		if (as->as_file == file && as->as_line == line)
+			break;
+	}
+	mtx_unlock(&aisite_lock);
+
+	return (n < AI_SITES) ? as : NULL;
+}
+
 static void
 register_allocation(void *addr, unsigned long size, char *file, int line,
     enum allocation_type atype, char *comment)
 {
 	struct allocation_info *a;
+	u_int bucket;
 
-	a = (struct allocation_info *) malloc(sizeof(struct allocation_info),
-	    M_MIRAGE, M_NOWAIT);
+	a = uma_zalloc(aizone, M_NOWAIT);
 	if (a != NULL) {
-		a->ai_file = file;
-		a->ai_line = line;
+		a->ai_site = ai_site(file, line);
 		a->ai_ptr = addr;
 		a->ai_size = size;
 		a->ai_type = atype;
 		a->ai_comment = comment;
-		mtx_lock(&aihead_lock);
-		TAILQ_INSERT_HEAD(&aihead, a, ai_next);
-		mtx_unlock(&aihead_lock);
+
+		if (a->ai_site != NULL) {
+			atomic_add_long(&a->ai_site->as_live, size);
+			atomic_add_long(&a->ai_site->as_allocs, 1);
+		}
+
+		bucket = ai_hash(addr);
+		mtx_lock(ai_lock(bucket));
+		LIST_INSERT_HEAD(&aihash[bucket], a, ai_next);
+		mtx_unlock(ai_lock(bucket));
 	}
 	else
 	printf("Warning: could not track allocation: p=%p, size=%ld, "
@@ -358,29 +763,79 @@ register_allocation(void *addr, unsigned long size, char *file, int line,
 static void
 unregister_allocation(void *addr, unsigned long size, char *file, int line)
 {
-	struct allocation_info *a, *a_tmp;
+	struct allocation_info *a;
+	u_int bucket;
 
-	mtx_lock(&aihead_lock);
-	TAILQ_FOREACH_SAFE(a, &aihead, ai_next, a_tmp) {
-		if (a->ai_ptr == addr) {
-			if ((size > 0 && a->ai_size == size) || size == 0) {
-				TAILQ_REMOVE(&aihead, a, ai_next);
-				if (a->ai_comment)
-					free(a->ai_comment, M_MIRAGE);
-				free(a, M_MIRAGE);
-			}
-			else
-			if (size > 0) {
-				a->ai_size -= size;
-			}
-			else
-			printf("Warning: could not track free: p=%p, size=%ld, "
-			    "loc=%s:%d\n", addr, size, file, line);
+	bucket = ai_hash(addr);
+	mtx_lock(ai_lock(bucket));
+	LIST_FOREACH(a, &aihash[bucket], ai_next) {
+		if (a->ai_ptr == addr)
 			break;
-		}
 	}
-	mtx_unlock(&aihead_lock);
+
+	if (a == NULL) {
+		mtx_unlock(ai_lock(bucket));
+		printf("Warning: could not track free: p=%p, size=%ld, "
+		    "loc=%s:%d\n", addr, size, file, line);
+		return;
+	}
+
+	if (size > 0 && a->ai_size != size) {
+		a->ai_size -= size;
+		mtx_unlock(ai_lock(bucket));
+		if (a->ai_site != NULL)
+			atomic_subtract_long(&a->ai_site->as_live, size);
+		return;
+	}
+
+	LIST_REMOVE(a, ai_next);
+	mtx_unlock(ai_lock(bucket));
+
+	if (a->ai_site != NULL) {
+		atomic_subtract_long(&a->ai_site->as_live, a->ai_size);
+		atomic_add_long(&a->ai_site->as_frees, 1);
+	}
+
+	if (a->ai_comment)
+		free(a->ai_comment, M_MIRAGE);
+	uma_zfree(aizone, a);
+}
+
+/* sysctl debug.mirage_allocs: the counters of every allocation site. */
+static int
+sysctl_mirage_allocs(SYSCTL_HANDLER_ARGS)
+{
+	struct allocation_site *as;
+	struct sbuf *sb;
+	int error, i;
+
+	sb = sbuf_new_for_sysctl(NULL, NULL, 4096, req);
+
+	if (sb == NULL)
+		return ENOMEM;
+
+	sbuf_printf(sb, "\n%10s %10s %10s  %s\n", "live", "allocs", "frees",
+	    "location");
+
+	mtx_lock(&aisite_lock);
+	for (i = 0; i < AI_SITES; i++) {
+		as = &aisites[i];
+
+		if (as->as_file == NULL)
+			continue;
+
+		sbuf_printf(sb, "%10lu %10lu %10lu  %s:%d\n", as->as_live,
+		    as->as_allocs, as->as_frees, as->as_file, as->as_line);
+	}
+	mtx_unlock(&aisite_lock);
+
+	error = sbuf_finish(sb);
+	sbuf_delete(sb);
+	return error;
 }
+
+SYSCTL_PROC(_debug, OID_AUTO, mirage_allocs, CTLTYPE_STRING | CTLFLAG_RD,
+    NULL, 0, sysctl_mirage_allocs, "A", "Mirage allocations per site");
 #endif
 
 #ifdef MEM_DEBUG
@@ -391,23 +846,21 @@ void *
 mir_malloc(unsigned long size, int flags)
 #endif
 {
-#ifdef MEM_LEAK
 	void *p;
-#endif
 
-	if (allocated() + size > mirage_memlimit) return NULL;
+	if (!mem_reserve(size))
+		return NULL;
 
-#ifdef MEM_LEAK
 	p = malloc(size, M_MIRAGE, flags);
+	mem_settle(size, malloc_size(p));
 
+#ifdef MEM_LEAK
 	if (p != NULL)
 		register_allocation(p, size, file, line, ALLOC_MALLOC,
 		    comment);
+#endif
 
 	return p;
-#else
-	return malloc(size, M_MIRAGE, flags);
-#endif
 }
 
 #ifdef MEM_DEBUG
@@ -419,35 +872,30 @@ void *
 mir_realloc(void *addr, unsigned long size, int flags)
 #endif
 {
-	uma_slab_t slab;
 	u_long old_size;
-#ifdef MEM_LEAK
 	void *p;
-#endif
 
-	slab = vtoslab((vm_offset_t)addr & (~UMA_SLAB_MASK));
+	old_size = malloc_size(addr);
 
-	if (slab == NULL)
+	if (addr != NULL && old_size == 0)
 		return NULL;
 
-	old_size = (!(slab->us_flags & UMA_SLAB_MALLOC)) ?
-	    slab->us_keg->uk_size : slab->us_size;
-
-	if (allocated() + (size - old_size) > mirage_memlimit) return NULL;
+	if (!mem_reserve(size - old_size))
+		return NULL;
 
-#ifdef MEM_LEAK
 	p = realloc(addr, size, M_MIRAGE, flags);
+	mem_settle(size - old_size,
+	    (p != NULL) ? malloc_size(p) - old_size : 0);
 
+#ifdef MEM_LEAK
 	if (p != NULL) {
 		unregister_allocation(addr, 0, file, line);
 		register_allocation(p, size, file, line, ALLOC_MALLOC,
 		    comment);
 	}
+#endif
 
 	return p;
-#else
-	return realloc(addr, size, M_MIRAGE, flags);
-#endif
 }
 
 #ifdef MEM_DEBUG
@@ -461,25 +909,24 @@ mir_contigmalloc(unsigned long size, int flags, vm_paddr_t low,
     vm_paddr_t high, unsigned long alignment, unsigned long boundary)
 #endif
 {
-#ifdef MEM_LEAK
 	void *p;
-#endif
 
-	if (allocated() + size > mirage_memlimit) return NULL;
+	if (!mem_reserve(size))
+		return NULL;
 
-#ifdef MEM_LEAK
 	p = contigmalloc(size, M_MIRAGE, flags, low, high, alignment,
 	    boundary);
 
+	if (p == NULL)
+		mem_settle(size, 0);
+
+#ifdef MEM_LEAK
 	if (p != NULL)
 		register_allocation(p, size, file, line, ALLOC_CONTIG,
 		    comment);
+#endif
 
 	return p;
-#else
-	return contigmalloc(size, M_MIRAGE, flags, low, high, alignment,
-	    boundary);
-#endif
 }
 
 #ifdef MEM_DEBUG
@@ -490,6 +937,7 @@ void
 mir_free(void *addr)
 #endif
 {
+	atomic_subtract_long(&mirage_memused, malloc_size(addr));
 	free(addr, M_MIRAGE);
 #ifdef MEM_LEAK
 	unregister_allocation(addr, 0, file, line);
@@ -504,59 +952,111 @@ void
 mir_contigfree(void *addr, unsigned long size)
 #endif
 {
+	atomic_subtract_long(&mirage_memused, size);
 	contigfree(addr, size, M_MIRAGE);
 #ifdef MEM_LEAK
 	unregister_allocation(addr, size, file, line);
 #endif
 }
 
+/*
+ * sysctl debug.mirage_malloc_bench: writing n makes n malloc/free pairs of
+ * a few sizes through mir_malloc(), the allocator behind caml_stat_alloc(),
+ * and reading gives the average cycles per pair of the last run.
+ */
+static int mirage_malloc_cycles;
+
+static int
+sysctl_mirage_malloc_bench(SYSCTL_HANDLER_ARGS)
+{
+	static const u_long sizes[] = { 16, 64, 256, 1024, 4096 };
+	uint64_t start;
+	void *p;
+	int error, i, n;
+
+	n = mirage_malloc_cycles;
+	error = sysctl_handle_int(oidp, &n, 0, req);
+
+	if (error != 0 || req->newptr == NULL)
+		return error;
+
+	if (n <= 0)
+		return EINVAL;
+
+	start = get_cyclecount();
+	for (i = 0; i < n; i++) {
+#ifdef MEM_DEBUG
+		p = mir_malloc(sizes[i % nitems(sizes)], M_NOWAIT, __FILE__,
+		    __LINE__, NULL);
+#else
+		p = mir_malloc(sizes[i % nitems(sizes)], M_NOWAIT);
+#endif
+		if (p == NULL)
+			return ENOMEM;
+#ifdef MEM_DEBUG
+		mir_free(p, __FILE__, __LINE__);
+#else
+		mir_free(p);
+#endif
+	}
+	mirage_malloc_cycles = (get_cyclecount() - start) / n;
+	return 0;
+}
+
+SYSCTL_PROC(_debug, OID_AUTO, mirage_malloc_bench, CTLTYPE_INT | CTLFLAG_RW,
+    NULL, 0, sysctl_mirage_malloc_bench, "I",
+    "Cycles per Mirage malloc/free pair");
+
 #ifdef MEM_LEAK
 static void
 check_for_leaks(void)
 {
-	struct allocation_info *a, *b;
-	int i, total;
+	struct allocation_info *a;
+	struct allocation_site *as;
+	int b, i, total;
 
-	mtx_lock(&aihead_lock);
-	a = TAILQ_FIRST(&aihead);
 	i = 0;
 	total = 0;
 
-	if (a != NULL)
-		printf("Memory leaks found:\n");
+	for (b = 0; b < AI_HASH_SIZE; b++) {
+		while ((a = LIST_FIRST(&aihash[b])) != NULL) {
+			if (i == 0)
+				printf("Memory leaks found:\n");
 
-	while (a != NULL) {
-		printf("[%d] p=%p, size=%ld, loc=%s:%d%s", i++, a->ai_ptr,
-		    a->ai_size, a->ai_file, a->ai_line,
-		    a->ai_comment ? " " : "\n");
+			as = a->ai_site;
+			printf("[%d] p=%p, size=%ld, loc=%s:%d%s", i++,
+			    a->ai_ptr, a->ai_size,
+			    as ? as->as_file : "?", as ? as->as_line : 0,
+			    a->ai_comment ? " " : "\n");
 
-		if (a->ai_comment) {
-			printf("(%s)\n", a->ai_comment);
-			free(a->ai_comment, M_MIRAGE);
-		}
+			if (a->ai_comment) {
+				printf("(%s)\n", a->ai_comment);
+				free(a->ai_comment, M_MIRAGE);
+			}
 
-		total += a->ai_size;
+			total += a->ai_size;
 
-		switch (a->ai_type) {
-		case ALLOC_MALLOC:
-			free(a->ai_ptr, M_MIRAGE);
-			break;
-		case ALLOC_CONTIG:
-			contigfree(a->ai_ptr, a->ai_size, M_MIRAGE);
-			break;
-		}
+			switch (a->ai_type) {
+			case ALLOC_MALLOC:
+				free(a->ai_ptr, M_MIRAGE);
+				break;
+			case ALLOC_CONTIG:
+				contigfree(a->ai_ptr, a->ai_size, M_MIRAGE);
+				break;
+			}
 
-		b = TAILQ_NEXT(a, ai_next);
-		free(a, M_MIRAGE);
-		a = b;
+			LIST_REMOVE(a, ai_next);
+			uma_zfree(aizone, a);
+		}
 	}
 
 	if (i > 0)
 		printf("\n%d allocations, %d bytes leaked.\n\n", i, total);
 
-	TAILQ_INIT(&aihead);
-	mtx_unlock(&aihead_lock);
-	mtx_destroy(&aihead_lock);
+	uma_zdestroy(aizone);
+	for (b = 0; b < AI_LOCKS; b++)
+		mtx_destroy(&ailocks[b]);
+	mtx_destroy(&aisite_lock);
 }
 #endif /* MEM_DEBUG */
 
@@ -36,6 +36,10 @@
 #include <sys/libkern.h>
 #include <sys/lock.h>
 #include <sys/mutex.h>
+#include <sys/rmlock.h>
+#include <sys/buf_ring.h>
+
+#include <machine/atomic.h>
 
 #include <net/if.h>
 #include <net/if_dl.h>
@@ -43,6 +47,10 @@
 #include <net/if_arp.h>
 #include <net/ethernet.h>
 
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+
 #include "caml/mlvalues.h"
 #include "caml/memory.h"
 #include "caml/alloc.h"
@@ -51,25 +59,85 @@
 
 static const u_char lladdr_all[ETHER_ADDR_LEN] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
 
-struct mbuf_entry {
-	LIST_ENTRY(mbuf_entry)	me_next;
-	struct mbuf		*me_m;
-};
+/*
+ * Default number of frames that may wait for Mirage on a plugged interface.
+ * It can be overridden by the "mirage.netif.rxqlen" kernel environment
+ * variable, and it is always rounded to a power of two, see buf_ring(9).
+ */
+#define NETIF_RX_RING_SIZE	1024
+#define NETIF_RX_RING_MIN	64
+#define NETIF_RX_RING_MAX	65536
+
+/* Maximum number of frames handed to OCaml in a single call. */
+#define NETIF_RX_BATCH_MAX	256
+
+/*
+ * An RX ring entry is either an mbuf owned by that plugged interface, or,
+ * with this bit set, a caml_ba_proxy holding a frame shared by several
+ * plugged interfaces.
+ */
+#define NETIF_RX_SHARED		((uintptr_t) 0x1)
+
+/* Backend ids are assigned modulo 256 by Netif. */
+#define NETIF_MAX_VIFS		256
+/* Only interfaces with an index below this can be plugged. */
+#define NETIF_MAX_IFINDEX	1024
+/* Size of the MAC address filter of a port, a power of two. */
+#define NETIF_MACTBL_SIZE	256
+#define NETIF_MACTBL_MASK	(NETIF_MACTBL_SIZE - 1)
+
+/*
+ * Offloads requested for an outgoing packet, and the checksums found good
+ * by the hardware on an incoming one.  Keep them in sync with Netif.
+ */
+#define NETIF_TX_CSUM_IP	0x01
+#define NETIF_TX_CSUM_TCP	0x02
+#define NETIF_TX_CSUM_UDP	0x04
+#define NETIF_TX_TSO		0x08
+#define NETIF_RX_CSUM_IP	0x01
+#define NETIF_RX_CSUM_L4	0x02
+/* The interface verifies the checksums of received frames. */
+#define NETIF_CAP_RXCSUM	0x10
+
+struct netif_port;
 
 struct plugged_if {
 	TAILQ_ENTRY(plugged_if)	pi_next;
+	TAILQ_ENTRY(plugged_if)	pi_port_next;
+	struct netif_port	*pi_port;
 	struct ifnet		*pi_ifp;
 	u_short	pi_index;
 	u_short	pi_llindex;
 	int	pi_flags;
 	u_char	pi_lladdr[ETHER_ADDR_LEN];	/* Real MAC address */
 	u_char	pi_lladdr_v[ETHER_ADDR_LEN];	/* Virtual MAC address */
-#ifdef NETIF_DEBUG
-	int	pi_rx_qlen;
-#endif
 	char	pi_xname[IFNAMSIZ];
-	struct  mtx			pi_rx_lock;
-	LIST_HEAD(, mbuf_entry)		pi_rx_head;
+	struct buf_ring	*pi_rx_ring;	/* Frames waiting for Mirage */
+	u_long	pi_rx_drops;		/* Frames dropped at the tail */
+	u_long	pi_tx_flushes;		/* Calls handing packets to the driver */
+	u_long	pi_tx_pkts;		/* Packets sent */
+	u_long	pi_tx_bytes;		/* Bytes sent */
+	u_long	pi_tx_errors;		/* Packets refused by the driver */
+};
+
+struct netif_macent {
+	u_char			me_addr[ETHER_ADDR_LEN];
+	struct plugged_if	*me_pip;	/* NULL if the slot is free */
+};
+
+/*
+ * A physical interface carrying one or more plugged interfaces.  Received
+ * frames are demultiplexed with an open-addressed hash table (linear
+ * probing) holding the unicast address of every plugged interface of the
+ * port, and the multicast groups they joined.  A multicast address appears
+ * once per member.  Broadcast frames go to every plugged interface.
+ */
+struct netif_port {
+	struct ifnet		*np_ifp;
+	u_short			np_llindex;
+	int			np_nmacs;
+	TAILQ_HEAD(, plugged_if)	np_vifs;
+	struct netif_macent	np_mac[NETIF_MACTBL_SIZE];
 };
 
 TAILQ_HEAD(plugged_ifhead, plugged_if) pihead =
@@ -77,14 +145,34 @@ TAILQ_HEAD(plugged_ifhead, plugged_if) pihead =
 
 static int plugged;
 
+/*
+ * Plugged interfaces indexed by backend id and ports indexed by if_index,
+ * for the per-frame lookups.  The tables, the ports and pihead are only
+ * modified by the Mirage kernel thread with pi_lock write-locked, so that
+ * thread may read them without locking, but netif_ether_input() must hold
+ * a read lock.
+ */
+static struct plugged_if *pi_by_index[NETIF_MAX_VIFS];
+static struct netif_port *port_by_llindex[NETIF_MAX_IFINDEX];
+static struct rmlock pi_lock;
+
 
 /* Currently only Ethernet interfaces are returned. */
 CAMLprim value caml_get_vifs(value v_unit);
 CAMLprim value caml_plug_vif(value id, value index, value mac);
-CAMLprim value caml_unplug_vif(value id);
-CAMLprim value caml_get_mbufs(value id);
+CAMLprim value caml_unplug_vif(value index);
+CAMLprim value caml_vif_join_group(value index, value mac);
+CAMLprim value caml_vif_leave_group(value index, value mac);
+CAMLprim value caml_get_mbuf_batch(value id, value max);
 CAMLprim value caml_get_next_mbuf(value id);
+CAMLprim value caml_get_next_mbuf_frags(value id);
 CAMLprim value caml_put_mbufs(value id, value bufs);
+CAMLprim value caml_put_mbufs_batch(value id, value pkts);
+CAMLprim value caml_get_vif_stats(value id);
+CAMLprim value caml_get_next_mbuf_csum(value id);
+CAMLprim value caml_put_mbufs_offload(value id, value bufs, value offload,
+    value tso_segsz);
+CAMLprim value caml_get_offload_caps(value id);
 
 /* netgraph(3) node hooks stolen from ng_ether(4) */
 extern void (*ng_ether_input_p)(struct ifnet *ifp, struct mbuf **mp);
@@ -96,6 +184,8 @@ extern void (*ng_ether_detach_p)(struct ifnet *ifp);
 void netif_init(void);
 void netif_deinit(void);
 
+void mirage_kthread_wakeup(void);
+
 static void netif_ether_input(struct ifnet *ifp, struct mbuf **mp);
 static int  netif_ether_output(struct ifnet *ifp, struct mbuf **mp);
 static void netif_ether_input_orphan(struct ifnet *ifp, struct mbuf *m);
@@ -109,40 +199,214 @@ static void (*prev_ng_ether_attach_p)(struct ifnet *ifp);
 static void (*prev_ng_ether_detach_p)(struct ifnet *ifp);
 
 
-static struct plugged_if *
-find_pi_by_index(u_short val)
+/* Depth of the RX ring of a new plugged interface. */
+static int
+netif_rx_ring_size(void)
 {
-	struct plugged_if *pip;
+	int size;
 
-	TAILQ_FOREACH(pip, &pihead, pi_next)
-		if (pip->pi_index == val)
-			return pip;
-	return NULL;
+	size = NETIF_RX_RING_SIZE;
+	getenv_int("mirage.netif.rxqlen", &size);
+	size = max(NETIF_RX_RING_MIN, min(size, NETIF_RX_RING_MAX));
+
+	/* Round up to the next power of two. */
+	return 1 << fls(size - 1);
+}
+
+static void
+netif_mbuf_release(struct caml_ba_proxy *proxy)
+{
+	m_freem((struct mbuf *) proxy->data);
+	__free(proxy);
+}
+
+/*
+ * Reference counted holder of an mbuf chain, so that Bigarrays can map its
+ * data without copying.  The caller owns the initial reference.
+ */
+static struct caml_ba_proxy *
+netif_mbuf_proxy(struct mbuf *m)
+{
+	struct caml_ba_proxy *proxy;
+
+	proxy = __malloc(sizeof(struct caml_ba_proxy));
+
+	if (proxy == NULL)
+		return NULL;
+
+	proxy->refcount = 1;
+	proxy->data     = m;
+	proxy->size     = m->m_pkthdr.len;
+	proxy->release  = netif_mbuf_release;
+	return proxy;
+}
+
+static void
+netif_proxy_ref(struct caml_ba_proxy *proxy)
+{
+	atomic_add_long((volatile u_long *) &proxy->refcount, 1);
+}
+
+static void
+netif_proxy_unref(struct caml_ba_proxy *proxy)
+{
+	if (atomic_fetchadd_long((volatile u_long *) &proxy->refcount, -1) == 1)
+		proxy->release(proxy);
+}
+
+static struct caml_ba_proxy *
+netif_rx_shared(void *entry)
+{
+	if (((uintptr_t) entry & NETIF_RX_SHARED) == 0)
+		return NULL;
+	return (struct caml_ba_proxy *) ((uintptr_t) entry & ~NETIF_RX_SHARED);
+}
+
+static void
+netif_rx_free(void *entry)
+{
+	struct caml_ba_proxy *proxy;
+
+	proxy = netif_rx_shared(entry);
+	if (proxy != NULL)
+		netif_proxy_unref(proxy);
+	else
+		m_freem((struct mbuf *) entry);
+}
+
+static void
+netif_rx_flush(struct plugged_if *pip)
+{
+	void *entry;
+
+	while ((entry = buf_ring_dequeue_sc(pip->pi_rx_ring)) != NULL)
+		netif_rx_free(entry);
 }
 
 static struct plugged_if *
-find_pi_by_llindex(u_short val)
+find_pi_by_index(u_short val)
 {
-	struct plugged_if *pip;
+	return (val < NETIF_MAX_VIFS) ? pi_by_index[val] : NULL;
+}
 
-	TAILQ_FOREACH(pip, &pihead, pi_next)
-		if (pip->pi_llindex == val)
-			return pip;
+static struct netif_port *
+find_port_by_llindex(u_short val)
+{
+	return (val < NETIF_MAX_IFINDEX) ? port_by_llindex[val] : NULL;
+}
 
-	return NULL;
+static u_int
+netif_mac_hash(const u_char *addr)
+{
+	/* The trailing bytes vary the most between generated addresses. */
+	return (addr[5] ^ (addr[4] << 3) ^ (addr[3] << 5) ^ (addr[2] << 7)) &
+	    NETIF_MACTBL_MASK;
 }
 
+/*
+ * Find the first plugged interface that accepts frames sent to addr,
+ * starting the probe at *slot.  On return, *slot is where the next
+ * probe should continue from.
+ */
 static struct plugged_if *
-find_pi_by_name(const char *val)
+netif_mac_lookup(struct netif_port *npp, const u_char *addr, u_int *slot)
 {
-	struct plugged_if *pip;
+	struct netif_macent *mep;
+	u_int i;
+
+	for (i = *slot; (mep = &npp->np_mac[i])->me_pip != NULL;
+	    i = (i + 1) & NETIF_MACTBL_MASK) {
+		if (bcmp(mep->me_addr, addr, ETHER_ADDR_LEN) == 0) {
+			*slot = (i + 1) & NETIF_MACTBL_MASK;
+			return mep->me_pip;
+		}
+	}
 
-	TAILQ_FOREACH(pip, &pihead, pi_next)
-		if (strncmp(pip->pi_xname, val, IFNAMSIZ) == 0)
-			return pip;
+	*slot = i;
 	return NULL;
 }
 
+static int
+netif_mac_add(struct netif_port *npp, const u_char *addr,
+    struct plugged_if *pip)
+{
+	struct netif_macent *mep;
+	u_int i;
+
+	/* Keep the table at most half full so that probes stay short. */
+	if (npp->np_nmacs >= NETIF_MACTBL_SIZE / 2)
+		return ENOSPC;
+
+	for (i = netif_mac_hash(addr); (mep = &npp->np_mac[i])->me_pip != NULL;
+	    i = (i + 1) & NETIF_MACTBL_MASK) {
+		/* Unicast addresses must be unique on the port. */
+		if (bcmp(mep->me_addr, addr, ETHER_ADDR_LEN) == 0 &&
+		    (mep->me_pip == pip || !ETHER_IS_MULTICAST(addr)))
+			return EEXIST;
+	}
+
+	bcopy(addr, mep->me_addr, ETHER_ADDR_LEN);
+	mep->me_pip = pip;
+	npp->np_nmacs++;
+	return 0;
+}
+
+static int
+netif_mac_del(struct netif_port *npp, const u_char *addr,
+    struct plugged_if *pip)
+{
+	struct netif_macent *mep;
+	u_int i, j, k;
+
+	for (i = netif_mac_hash(addr); (mep = &npp->np_mac[i])->me_pip != NULL;
+	    i = (i + 1) & NETIF_MACTBL_MASK) {
+		if (mep->me_pip == pip &&
+		    bcmp(mep->me_addr, addr, ETHER_ADDR_LEN) == 0)
+			break;
+	}
+
+	if (mep->me_pip == NULL)
+		return ENOENT;
+
+	/*
+	 * Shift the rest of the cluster back instead of leaving a tombstone:
+	 * the entry at j may fill the hole at i unless its home slot k lies
+	 * cyclically in (i, j].
+	 */
+	mep->me_pip = NULL;
+	for (j = i;;) {
+		j = (j + 1) & NETIF_MACTBL_MASK;
+		if (npp->np_mac[j].me_pip == NULL)
+			break;
+		k = netif_mac_hash(npp->np_mac[j].me_addr);
+		if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		npp->np_mac[i] = npp->np_mac[j];
+		npp->np_mac[j].me_pip = NULL;
+		i = j;
+	}
+
+	npp->np_nmacs--;
+	return 0;
+}
+
+static void
+netif_mac_del_all(struct netif_port *npp, struct plugged_if *pip)
+{
+	u_char addr[ETHER_ADDR_LEN];
+	u_int i;
+
+	for (i = 0; i < NETIF_MACTBL_SIZE; ) {
+		if (npp->np_mac[i].me_pip == pip) {
+			/* Another entry may be shifted into slot i. */
+			bcopy(npp->np_mac[i].me_addr, addr, ETHER_ADDR_LEN);
+			netif_mac_del(npp, addr, pip);
+			continue;
+		}
+		i++;
+	}
+}
+
 CAMLprim value
 caml_get_vifs(value v_unit)
 {
@@ -182,23 +446,45 @@ caml_plug_vif(value id, value index, value mac)
 	struct ifnet *ifp;
 	struct sockaddr_dl *sdl;
 	struct plugged_if *pip;
+	struct netif_port *npp;
 	char*	lladdr;
-	int found;
+	int found, error;
 #ifdef NETIF_DEBUG
 	u_char	*p1, *p2;
 #endif
 
+	lladdr = String_val(mac);
+
+	if (Int_val(index) < 0 || Int_val(index) >= NETIF_MAX_VIFS ||
+	    pi_by_index[Int_val(index)] != NULL)
+		caml_failwith("Invalid backend id");
+
+	if (ETHER_IS_MULTICAST(lladdr))
+		caml_failwith("Invalid MAC address");
+
 	pip = __calloc(1, sizeof(struct plugged_if));
 
 	if (pip == NULL)
 		caml_failwith("No memory for plugging a new interface");
 
+	pip->pi_rx_ring = buf_ring_alloc(netif_rx_ring_size(), M_DEVBUF,
+	    M_NOWAIT, NULL);
+
+	if (pip->pi_rx_ring == NULL) {
+		__free(pip);
+		caml_failwith("No memory for plugging a new interface");
+	}
+
 	found = 0;
 	IFNET_WLOCK();
 	TAILQ_FOREACH(ifp, &V_ifnet, if_link) {
 		if (strncmp(ifp->if_xname, String_val(id), IFNAMSIZ) != 0)
 			continue;
 
+		/* There is no slot for it in port_by_llindex. */
+		if (ifp->if_index >= NETIF_MAX_IFINDEX)
+			break;
+
 		/* Add a fake NetGraph node, if needed. */
 		if (IFP2AC(ifp)->ac_netgraph == NULL)
 			IFP2AC(ifp)->ac_netgraph = (void *) 1;
@@ -222,23 +508,50 @@ caml_plug_vif(value id, value index, value mac)
 	IFNET_WUNLOCK();
 
 	if (!found) {
+		buf_ring_free(pip->pi_rx_ring, M_DEVBUF);
 		__free(pip);
 		caml_failwith("Invalid interface");
 	}
 
 	pip->pi_index = Int_val(index);
-
-	lladdr = String_val(mac);
 	bcopy(lladdr, pip->pi_lladdr_v, ETHER_ADDR_LEN);
 
-	mtx_init(&pip->pi_rx_lock, "plugged_if_rx", NULL, MTX_DEF);
-	LIST_INIT(&pip->pi_rx_head);
-
-	if (plugged == 0)
-		TAILQ_INIT(&pihead);
+	/* The first plugged interface on an ifnet creates its port. */
+	npp = find_port_by_llindex(pip->pi_llindex);
+	if (npp == NULL) {
+		npp = __calloc(1, sizeof(struct netif_port));
+		if (npp == NULL) {
+			buf_ring_free(pip->pi_rx_ring, M_DEVBUF);
+			__free(pip);
+			caml_failwith("No memory for plugging a new interface");
+		}
+		npp->np_ifp = pip->pi_ifp;
+		npp->np_llindex = pip->pi_llindex;
+		TAILQ_INIT(&npp->np_vifs);
+	}
+	pip->pi_port = npp;
+
+	rm_wlock(&pi_lock);
+	error = netif_mac_add(npp, pip->pi_lladdr_v, pip);
+	if (error == 0) {
+		if (plugged == 0)
+			TAILQ_INIT(&pihead);
+
+		TAILQ_INSERT_TAIL(&pihead, pip, pi_next);
+		TAILQ_INSERT_TAIL(&npp->np_vifs, pip, pi_port_next);
+		pi_by_index[pip->pi_index] = pip;
+		port_by_llindex[npp->np_llindex] = npp;
+		plugged++;
+	}
+	rm_wunlock(&pi_lock);
 
-	TAILQ_INSERT_TAIL(&pihead, pip, pi_next);
-	plugged++;
+	if (error != 0) {
+		if (TAILQ_EMPTY(&npp->np_vifs))
+			__free(npp);
+		buf_ring_free(pip->pi_rx_ring, M_DEVBUF);
+		__free(pip);
+		caml_failwith("MAC address is already in use");
+	}
 
 #ifdef NETIF_DEBUG
 	p1 = pip->pi_lladdr;
@@ -254,62 +567,186 @@ caml_plug_vif(value id, value index, value mac)
 }
 
 CAMLprim value
-caml_unplug_vif(value id)
+caml_unplug_vif(value index)
 {
-	CAMLparam1(id);
+	CAMLparam1(index);
 	struct plugged_if *pip;
+	struct netif_port *npp;
 	struct ifnet *ifp;
-	struct mbuf_entry *e1;
-	struct mbuf_entry *e2;
 
-	pip = find_pi_by_name(String_val(id));
+	pip = find_pi_by_index(Int_val(index));
 	if (pip == NULL)
 		CAMLreturn(Val_unit);
 
-	IFNET_WLOCK();
-	TAILQ_FOREACH(ifp, &V_ifnet, if_link) {
-		if (strncmp(ifp->if_xname, String_val(id), IFNAMSIZ) == 0) {
-			/* Remove the fake NetGraph node, if there was any. */
-			if (IFP2AC(ifp)->ac_netgraph == (void *) 1)
-				IFP2AC(ifp)->ac_netgraph = (void *) 0;
-			break;
-		}
-	}
-	IFNET_WUNLOCK();
-
 #ifdef NETIF_DEBUG
-	printf("caml_unplug_vif: ifname=[%s]\n", pip->pi_xname);
+	printf("caml_unplug_vif: ifname=[%s] dropped=%lu\n", pip->pi_xname,
+	    pip->pi_rx_drops);
 #endif
 
+	npp = pip->pi_port;
+
+	/* Once the lock is acquired, no receiver can refer to pip. */
+	rm_wlock(&pi_lock);
 	TAILQ_REMOVE(&pihead, pip, pi_next);
+	TAILQ_REMOVE(&npp->np_vifs, pip, pi_port_next);
+	netif_mac_del_all(npp, pip);
+	pi_by_index[pip->pi_index] = NULL;
+	if (TAILQ_EMPTY(&npp->np_vifs))
+		port_by_llindex[npp->np_llindex] = NULL;
+	plugged--;
+	rm_wunlock(&pi_lock);
 
-	e1 = LIST_FIRST(&pip->pi_rx_head);
-	while (e1 != NULL) {
-		e2 = LIST_NEXT(e1, me_next);
-		m_freem(e1->me_m);
-		__free(e1);
-		e1 = e2;
+	if (TAILQ_EMPTY(&npp->np_vifs)) {
+		IFNET_WLOCK();
+		TAILQ_FOREACH(ifp, &V_ifnet, if_link) {
+			if (ifp == npp->np_ifp) {
+				/* Remove the fake NetGraph node, if any. */
+				if (IFP2AC(ifp)->ac_netgraph == (void *) 1)
+					IFP2AC(ifp)->ac_netgraph = (void *) 0;
+				break;
+			}
+		}
+		IFNET_WUNLOCK();
+		__free(npp);
 	}
-	LIST_INIT(&pip->pi_rx_head);
-	mtx_destroy(&pip->pi_rx_lock);
+
+	netif_rx_flush(pip);
+	buf_ring_free(pip->pi_rx_ring, M_DEVBUF);
 
 	__free(pip);
-	plugged--;
 
 	CAMLreturn(Val_unit);
 }
 
+CAMLprim value
+caml_vif_join_group(value index, value mac)
+{
+	CAMLparam2(index, mac);
+	struct plugged_if *pip;
+	int error;
+
+	pip = find_pi_by_index(Int_val(index));
+
+	if (pip == NULL)
+		caml_failwith("No interface");
+
+	if (!ETHER_IS_MULTICAST(String_val(mac)))
+		caml_failwith("Not a multicast address");
+
+	rm_wlock(&pi_lock);
+	error = netif_mac_add(pip->pi_port, String_val(mac), pip);
+	rm_wunlock(&pi_lock);
+
+	if (error == ENOSPC)
+		caml_failwith("Too many MAC addresses on the interface");
+
+	CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+caml_vif_leave_group(value index, value mac)
+{
+	CAMLparam2(index, mac);
+	struct plugged_if *pip;
+
+	pip = find_pi_by_index(Int_val(index));
+
+	if (pip == NULL)
+		caml_failwith("No interface");
+
+	rm_wlock(&pi_lock);
+	netif_mac_del(pip->pi_port, String_val(mac), pip);
+	rm_wunlock(&pi_lock);
+
+	CAMLreturn(Val_unit);
+}
+
+/*
+ * Frames are enqueued from netif_ether_input(), which may run in several
+ * threads at once (driver ithreads and the output path), and dequeued only
+ * by the Mirage kernel thread, so the multi-producer/single-consumer
+ * buf_ring(9) is used without any further locking.
+ *
+ * Queue a frame for a plugged interface, return whether it could be
+ * queued.  Frames are delivered in arrival order, so when the ring is full
+ * the newest frame is the one to drop: it is accounted in pi_rx_drops and
+ * left to the caller.
+ */
+static int
+netif_rx_enqueue(struct plugged_if *pip, void *entry)
+{
+	if (buf_ring_enqueue(pip->pi_rx_ring, entry) != 0) {
+		atomic_add_long(&pip->pi_rx_drops, 1);
+		return 0;
+	}
+
+#ifdef NETIF_DEBUG
+	printf("[%s]: %d frames are queued.\n", pip->pi_xname,
+	    buf_ring_count(pip->pi_rx_ring));
+#endif
+
+	return 1;
+}
+
+/* Queue a reference to a shared frame. */
+static int
+netif_rx_enqueue_shared(struct plugged_if *pip, struct caml_ba_proxy *proxy)
+{
+	netif_proxy_ref(proxy);
+
+	if (!netif_rx_enqueue(pip,
+	    (void *) ((uintptr_t) proxy | NETIF_RX_SHARED))) {
+		netif_proxy_unref(proxy);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Whether a frame looped back to the port was sent by pip. */
+static int
+netif_is_sender(struct plugged_if *pip, struct ether_header *eh)
+{
+	return bcmp(eh->ether_shost, pip->pi_lladdr_v, ETHER_ADDR_LEN) == 0;
+}
+
+/*
+ * The plugged interface of the port after pip (or the first one if pip is
+ * NULL) that should receive a broadcast or multicast frame.  For
+ * multicast, *slot holds the state of the probe, see netif_mac_lookup().
+ * Frames sent by a plugged interface are not looped back to it.
+ */
+static struct plugged_if *
+netif_rx_next_member(struct netif_port *npp, struct plugged_if *pip,
+    struct ether_header *eh, int bcast, u_int *slot)
+{
+	if (bcast) {
+		pip = (pip == NULL) ? TAILQ_FIRST(&npp->np_vifs) :
+		    TAILQ_NEXT(pip, pi_port_next);
+		while (pip != NULL && netif_is_sender(pip, eh))
+			pip = TAILQ_NEXT(pip, pi_port_next);
+	}
+	else {
+		while ((pip = netif_mac_lookup(npp, eh->ether_dhost,
+		    slot)) != NULL && netif_is_sender(pip, eh))
+			;
+	}
+
+	return pip;
+}
+
 /* Listening to incoming Ethernet frames. */
 void
 netif_ether_input(struct ifnet *ifp, struct mbuf **mp)
 {
+	struct rm_priotracker tracker;
+	struct netif_port *npp;
 	struct plugged_if *pip;
-	struct mbuf_entry *e;
 	struct ether_header *eh;
-	char mine, bcast;
-#ifdef NETIF_DEBUG
-	int i;
-#endif
+	struct caml_ba_proxy *proxy;
+	struct mbuf *m;
+	u_int slot;
+	int bcast, queued;
 
 #ifdef NETIF_DEBUG
 	printf("New incoming frame on if=[%s]!\n", ifp->if_xname);
@@ -322,179 +759,186 @@ netif_ether_input(struct ifnet *ifp, struct mbuf **mp)
 		goto end;
 	}
 
-	pip = find_pi_by_llindex(ifp->if_index);
+	rm_rlock(&pi_lock, &tracker);
+	npp = find_port_by_llindex(ifp->if_index);
 
-	if (pip == NULL) {
+	if (npp == NULL) {
 #ifdef NETIF_DEBUG
 		printf("No interface found for index: %d\n", ifp->if_index);
 #endif
-		goto end;
+		goto unlock;
 	}
 
 	eh = mtod(*mp, struct ether_header *);
-	mine  = bcmp(eh->ether_dhost, pip->pi_lladdr_v, ETHER_ADDR_LEN) == 0;
-	bcast = bcmp(eh->ether_dhost, lladdr_all, ETHER_ADDR_LEN) == 0;
+	queued = 0;
 
 #ifdef NETIF_DEBUG
-	printf("Destination: %02x:%02x:%02x:%02x:%02x:%02x (%04x), %s.\n",
+	printf("Destination: %02x:%02x:%02x:%02x:%02x:%02x (%04x).\n",
 	    eh->ether_dhost[0], eh->ether_dhost[1], eh->ether_dhost[2],
 	    eh->ether_dhost[3], eh->ether_dhost[4], eh->ether_dhost[5],
-	    ntohs(eh->ether_type), (mine || bcast) ? "intercepting" : "skipping");
+	    ntohs(eh->ether_type));
 #endif
 
-	/* Let the frame escape if it is neither ours nor broadcast. */
-	if (!mine && !bcast)
-		goto end;
-
-	e = (struct mbuf_entry *) __malloc(sizeof(struct mbuf_entry));
+	if (ETHER_IS_MULTICAST(eh->ether_dhost)) {
+		bcast = bcmp(eh->ether_dhost, lladdr_all, ETHER_ADDR_LEN) == 0;
+		slot = netif_mac_hash(eh->ether_dhost);
+
+		/* Most group traffic has no member, so look before copying. */
+		pip = netif_rx_next_member(npp, NULL, eh, bcast, &slot);
+		if (pip == NULL)
+			goto unlock;
+
+		/*
+		 * The host keeps the frame, the plugged interfaces share a
+		 * single read-only reference to its data.
+		 */
+		m = m_copypacket(*mp, M_DONTWAIT);
+		if (m == NULL)
+			goto unlock;
+		proxy = netif_mbuf_proxy(m);
+		if (proxy == NULL) {
+			m_freem(m);
+			goto unlock;
+		}
 
-	/* Out of memory, cannot do much. */
-	if (e == NULL)
-		goto end;
+		do {
+			queued |= netif_rx_enqueue_shared(pip, proxy);
+		} while ((pip = netif_rx_next_member(npp, pip, eh, bcast,
+		    &slot)) != NULL);
 
-	e->me_m = bcast ? m_copypacket(*mp, M_DONTWAIT) : *mp;
-	mtx_lock(&pip->pi_rx_lock);
-	LIST_INSERT_HEAD(&pip->pi_rx_head, e, me_next);
-#ifdef NETIF_DEBUG
-	i = (++pip->pi_rx_qlen);
-#endif
-	mtx_unlock(&pip->pi_rx_lock);
-#ifdef NETIF_DEBUG
-	printf("[%s]: %d frames are queued.\n", pip->pi_xname, i);
-#endif
+		netif_proxy_unref(proxy);
+	}
+	else {
+		/* Unicast: steal the frame if it is ours. */
+		slot = netif_mac_hash(eh->ether_dhost);
+		pip = netif_mac_lookup(npp, eh->ether_dhost, &slot);
+		if (pip != NULL) {
+			queued = netif_rx_enqueue(pip, *mp);
+			if (!queued)
+				m_freem(*mp);
+			*mp = NULL;
+		}
+	}
 
-	if (!bcast)
-		*mp = NULL;
+	if (queued)
+		mirage_kthread_wakeup();
 
+unlock:
+	rm_runlock(&pi_lock, &tracker);
 end:
 	if (prev_ng_ether_input_p != NULL && (*mp) != NULL)
 		(*prev_ng_ether_input_p)(ifp, mp);
 }
 
-CAMLprim value
-caml_get_mbufs(value id)
+/*
+ * Received frames are wrapped in two steps.  The Bigarrays are allocated
+ * while the entry is still at the head of the ring, so that if OCaml runs
+ * out of memory the frame stays queued.  Once the entry has been taken,
+ * netif_mbuf_attach() hands them a reference to the frame, which cannot
+ * fail.
+ */
+static value
+netif_mbuf_ba(void *data, long len)
 {
-	CAMLparam1(id);
-	CAMLlocal3(result, t, r);
-	struct plugged_if *pip;
-	struct mbuf_entry *e1;
-	struct mbuf_entry *e2;
-	struct mbuf *m;
-	struct mbuf *n;
-#ifdef NETIF_DEBUG
-	int num_pages;
-#endif
-
-#ifdef NETIF_DEBUG
-	printf("caml_get_mbufs(): invoked\n");
-#endif
+	return caml_ba_alloc_dims(CAML_BA_UINT8 | CAML_BA_C_LAYOUT, 1, data,
+	    len);
+}
 
-	result = Val_emptylist;
+static void
+netif_mbuf_attach(value v, struct caml_ba_proxy *proxy)
+{
+	struct caml_ba_array *b;
 
-	if (plugged == 0)
-		CAMLreturn(result);
+	b = Caml_ba_array_val(v);
+	b->flags |= CAML_BA_FBSD_MBUF;
+	b->proxy  = proxy;
+	netif_proxy_ref(proxy);
+	/* Collect about once per ring worth of clusters, so that they return. */
+	caml_adjust_gc_speed(b->dim[0], NETIF_RX_RING_SIZE * MCLBYTES);
+}
 
-	pip = find_pi_by_index(Int_val(id));
+/* Take over the entry at the head of the ring, as a proxy reference. */
+static struct caml_ba_proxy *
+netif_rx_take(struct plugged_if *pip, void *entry)
+{
+	struct caml_ba_proxy *proxy;
 
-#ifdef NETIF_DEBUG
-	printf("caml_get_mbufs(): pip=%p\n", pip);
-	num_pages = 0;
-#endif
+	buf_ring_advance_sc(pip->pi_rx_ring);
+	proxy = netif_rx_shared(entry);
 
-	if (pip == NULL)
-		CAMLreturn(result);
-
-	mtx_lock(&pip->pi_rx_lock);
-	e1 = LIST_FIRST(&pip->pi_rx_head);
-	while (e1 != NULL) {
-		for (m = e1->me_m; m != NULL; m = m->m_nextpkt) {
-			for (n = m; n != NULL; n = n->m_next) {
-				t = caml_alloc(3, 0);
-				Store_field(t, 0,
-				    caml_ba_alloc_dims(CAML_BA_UINT8
-				    | CAML_BA_C_LAYOUT | CAML_BA_FBSD_MBUF, 1,
-				    (void *) n, (long) n->m_len));
-				Store_field(t, 1, Val_int(0));
-				Store_field(t, 2, Val_int(n->m_len));
-				r = caml_alloc(2, 0);
-				Store_field(r, 0, t);
-				Store_field(r, 1, result);
-				result = r;
-#ifdef NETIF_DEBUG
-				num_pages++;
-				pip->pi_rx_qlen--;
-#endif
-			}
+	if (proxy == NULL) {
+		/* The proxy takes over the reference of the entry. */
+		proxy = netif_mbuf_proxy((struct mbuf *) entry);
+		if (proxy == NULL) {
+			m_freem((struct mbuf *) entry);
+			caml_raise_out_of_memory();
 		}
-		e2 = LIST_NEXT(e1, me_next);
-		__free(e1);
-		e1 = e2;
 	}
-	LIST_INIT(&pip->pi_rx_head);
-	mtx_unlock(&pip->pi_rx_lock);
-
-#ifdef NETIF_DEBUG
-	printf("caml_get_mbufs(): shipped %d pages.\n", num_pages);
-#endif
 
-	CAMLreturn(result);
+	return proxy;
 }
 
-CAMLprim value
-caml_get_next_mbuf(value id)
+/*
+ * Checksums of a received frame the hardware found good, as
+ * NETIF_RX_CSUM_* flags.
+ */
+static int
+netif_rx_csum(void *entry)
 {
-	CAMLparam1(id);
-	CAMLlocal2(result, v);
-	struct plugged_if *pip;
-	struct mbuf_entry *ep;
+	struct caml_ba_proxy *proxy;
 	struct mbuf *m;
-	long len;
+	int flags;
 
-	pip = find_pi_by_index(Int_val(id));
+	proxy = netif_rx_shared(entry);
+	m = (proxy != NULL) ? (struct mbuf *) proxy->data : entry;
+	flags = 0;
 
-	if (pip == NULL)
-		caml_failwith("No interface");
+	if ((m->m_pkthdr.csum_flags & (CSUM_IP_CHECKED | CSUM_IP_VALID)) ==
+	    (CSUM_IP_CHECKED | CSUM_IP_VALID))
+		flags |= NETIF_RX_CSUM_IP;
 
-#ifdef NETIF_DEBUG
-	printf("caml_get_next_mbufs(): [%s]\n", pip->pi_xname);
-#endif
-
-	mtx_lock(&pip->pi_rx_lock);
-	ep = LIST_FIRST(&pip->pi_rx_head);
-	mtx_unlock(&pip->pi_rx_lock);
-
-	/* No frame today. */
-	if (ep == NULL)
-		CAMLreturn(Val_none);
+	if ((m->m_pkthdr.csum_flags & (CSUM_DATA_VALID | CSUM_PSEUDO_HDR)) ==
+	    (CSUM_DATA_VALID | CSUM_PSEUDO_HDR) &&
+	    m->m_pkthdr.csum_data == 0xffff)
+		flags |= NETIF_RX_CSUM_L4;
 
-	m = ep->me_m;
+	return flags;
+}
 
-	mtx_lock(&pip->pi_rx_lock);
-	if (m->m_nextpkt == NULL) {
-		LIST_REMOVE(ep, me_next);
-#ifdef NETIF_DEBUG
-		pip->pi_rx_qlen--;
-#endif
-	}
-	else
-		ep->me_m = m->m_nextpkt;
-	mtx_unlock(&pip->pi_rx_lock);
+/*
+ * Wrap the frame at the head of the RX ring of pip into a Cstruct.t, and
+ * take it off the ring.  Frames shared with other plugged interfaces are
+ * mapped as well, so they must not be modified.
+ */
+static value
+netif_mbuf_to_cstruct(struct plugged_if *pip)
+{
+	CAMLparam0();
+	CAMLlocal2(result, v);
+	struct caml_ba_proxy *proxy;
+	struct mbuf *m;
+	void *entry;
+	long len;
 
-	if (m->m_nextpkt == NULL)
-		__free(ep);
+	entry = buf_ring_peek(pip->pi_rx_ring);
+	proxy = netif_rx_shared(entry);
+	m = (proxy != NULL) ? proxy->data : entry;
 
 	/* Flatten packet if it is multi-part. */
 	if (m->m_next != NULL) {
 		len = m->m_pkthdr.len;
-		v = caml_ba_alloc_dims(CAML_BA_UINT8 | CAML_BA_C_LAYOUT, 1,
-		    NULL, len);
+		v = netif_mbuf_ba(NULL, len);
 		m_copydata(m, 0, len, Caml_ba_array_val(v)->data);
-		m_freem(m);
+		buf_ring_advance_sc(pip->pi_rx_ring);
+		netif_rx_free(entry);
 	}
 	else {
 		len = m->m_len;
-		v = caml_ba_alloc_dims(CAML_BA_UINT8 | CAML_BA_C_LAYOUT |
-		    CAML_BA_FBSD_MBUF, 1, (void *) m, len);
+		v = netif_mbuf_ba(mtod(m, void *), len);
+		proxy = netif_rx_take(pip, entry);
+		netif_mbuf_attach(v, proxy);
+		/* Drop the reference of the entry. */
+		netif_proxy_unref(proxy);
 	}
 
 	result = caml_alloc(3, 0);
@@ -507,6 +951,169 @@ caml_get_next_mbuf(value id)
 	    Caml_ba_array_val(v)->data);
 #endif
 
+	CAMLreturn(result);
+}
+
+/*
+ * Wrap the frame at the head of the RX ring of pip into a list of
+ * Cstruct.t, one per mbuf of the chain, without copying, and take it off
+ * the ring.  The chain is freed once all of them have been collected.
+ */
+static value
+netif_mbuf_to_frags(struct plugged_if *pip)
+{
+	CAMLparam0();
+	CAMLlocal5(result, last, t, r, v);
+	struct caml_ba_proxy *proxy;
+	struct mbuf *m;
+	void *entry;
+
+	entry = buf_ring_peek(pip->pi_rx_ring);
+	proxy = netif_rx_shared(entry);
+	m = (proxy != NULL) ? proxy->data : entry;
+
+	result = Val_emptylist;
+
+	for (; m != NULL; m = m->m_next) {
+		if (m->m_len == 0)
+			continue;
+		v = netif_mbuf_ba(mtod(m, void *), m->m_len);
+		t = caml_alloc(3, 0);
+		Store_field(t, 0, v);
+		Store_field(t, 1, Val_int(0));
+		Store_field(t, 2, Val_int(m->m_len));
+		r = caml_alloc(2, 0);
+		Store_field(r, 0, t);
+		Store_field(r, 1, Val_emptylist);
+		if (result == Val_emptylist)
+			result = r;
+		else
+			Store_field(last, 1, r);
+		last = r;
+	}
+
+	proxy = netif_rx_take(pip, entry);
+
+	for (r = result; r != Val_emptylist; r = Field(r, 1))
+		netif_mbuf_attach(Field(Field(r, 0), 0), proxy);
+
+	/* Drop the reference of the entry. */
+	netif_proxy_unref(proxy);
+
+	CAMLreturn(result);
+}
+
+CAMLprim value
+caml_get_mbuf_batch(value id, value max)
+{
+	CAMLparam2(id, max);
+	CAMLlocal2(result, frame);
+	struct plugged_if *pip;
+	int i, n, num;
+
+	num = min(Int_val(max), NETIF_RX_BATCH_MAX);
+
+	if (plugged == 0 || num <= 0)
+		CAMLreturn(Atom(0));
+
+	pip = find_pi_by_index(Int_val(id));
+
+	if (pip == NULL)
+		caml_failwith("No interface");
+
+	/*
+	 * Only this thread dequeues, so at least n frames are there.  They
+	 * are taken one at a time while the result is filled, so that if
+	 * wrapping one raises, it and the others are still in the ring.
+	 */
+	n = min(num, buf_ring_count(pip->pi_rx_ring));
+
+#ifdef NETIF_DEBUG
+	printf("caml_get_mbuf_batch(): [%s] %d frames\n", pip->pi_xname, n);
+#endif
+
+	/* No frame today. */
+	if (n == 0)
+		CAMLreturn(Atom(0));
+
+	result = caml_alloc(n, 0);
+	for (i = 0; i < n; i++) {
+		frame = netif_mbuf_to_cstruct(pip);
+		Store_field(result, i, frame);
+	}
+
+	CAMLreturn(result);
+}
+
+CAMLprim value
+caml_get_next_mbuf(value id)
+{
+	CAMLparam1(id);
+	CAMLlocal1(result);
+	struct plugged_if *pip;
+
+	pip = find_pi_by_index(Int_val(id));
+
+	if (pip == NULL)
+		caml_failwith("No interface");
+
+#ifdef NETIF_DEBUG
+	printf("caml_get_next_mbufs(): [%s]\n", pip->pi_xname);
+#endif
+
+	/* No frame today. */
+	if (buf_ring_peek(pip->pi_rx_ring) == NULL)
+		CAMLreturn(Val_none);
+
+	result = netif_mbuf_to_cstruct(pip);
+	CAMLreturn(Val_some(result));
+}
+
+CAMLprim value
+caml_get_next_mbuf_frags(value id)
+{
+	CAMLparam1(id);
+	CAMLlocal1(result);
+	struct plugged_if *pip;
+
+	pip = find_pi_by_index(Int_val(id));
+
+	if (pip == NULL)
+		caml_failwith("No interface");
+
+	/* No frame today. */
+	if (buf_ring_peek(pip->pi_rx_ring) == NULL)
+		CAMLreturn(Val_none);
+
+	result = netif_mbuf_to_frags(pip);
+	CAMLreturn(Val_some(result));
+}
+
+CAMLprim value
+caml_get_next_mbuf_csum(value id)
+{
+	CAMLparam1(id);
+	CAMLlocal2(result, frame);
+	struct plugged_if *pip;
+	void *entry;
+	int flags;
+
+	pip = find_pi_by_index(Int_val(id));
+
+	if (pip == NULL)
+		caml_failwith("No interface");
+
+	entry = buf_ring_peek(pip->pi_rx_ring);
+
+	/* No frame today. */
+	if (entry == NULL)
+		CAMLreturn(Val_none);
+
+	flags = netif_rx_csum(entry);
+	frame = netif_mbuf_to_cstruct(pip);
+	result = caml_alloc_tuple(2);
+	Store_field(result, 0, frame);
+	Store_field(result, 1, Val_int(flags));
 	CAMLreturn(Val_some(result));
 }
 
@@ -559,45 +1166,68 @@ netif_mbuf_free(struct mbuf *__nothing, void *p1, void *p2)
 	printf("netif_mbuf_free: %p, %p\n", p1, p2);
 #endif
 
-	if (--(proxy->refcount) > 0)
-        return (EXT_FREE_OK);
+	/*
+	 * Every mbuf holds a reference to the Bigarray proxy, so io-pages
+	 * return to their pool once both OCaml and the driver are done.
+	 */
+	netif_proxy_unref(proxy);
 
-	switch (proxy->type) {
-		case CAML_FREEBSD_IOPAGE:
-			__contigfree(p2, proxy->size);
-			break;
+	return (EXT_FREE_OK);
+}
 
-		case CAML_FREEBSD_MBUF:
-			__free(p2);
-			break;
+/* Copy len bytes at p to a chain of clusters. */
+static struct mbuf *
+netif_copy_to_mbuf(const char *p, size_t len)
+{
+	struct mbuf **mp;
+	struct mbuf *m;
+	struct mbuf *frag;
 
-		default:
-			printf("Unknown Bigarray metadata type: %02x\n",
-			    proxy->type);
-			break;
-	}
+	frag = NULL;
+	mp = &frag;
 
-	__free(proxy);
+	while (len > 0) {
+		m = m_getcl(M_DONTWAIT, MT_DATA, 0);
 
-    return (EXT_FREE_OK);
+		if (m == NULL) {
+			m_freem(frag);
+			return NULL;
+		}
+
+		m->m_len = min(MCLBYTES, len);
+		bcopy(p, mtod(m, void *), m->m_len);
+
+		len -= m->m_len;
+		p += m->m_len;
+		*mp = m;
+		mp = &(m->m_next);
+	}
+
+	return frag;
 }
 
+/*
+ * Map frag_len bytes from v_off in a Bigarray to a chain of mbufs.  Only
+ * io-pages and received frames are owned by the kernel and can be lent
+ * to the driver, the data of any other Bigarray is copied.
+ */
 static struct mbuf *
-netif_map_to_mbuf(struct caml_ba_array *b, int v_off, int *v_len)
+netif_map_to_mbuf(struct caml_ba_array *b, long v_off, size_t frag_len)
 {
 	struct mbuf **mp;
 	struct mbuf *m;
 	struct mbuf *frag;
 	struct caml_ba_proxy *proxy;
 	void *data;
-	size_t frag_len;
 	char *p;
 
 	proxy = b->proxy;
 	data = (char *) b->data + v_off;
-	frag_len = min(proxy->size - v_off, *v_len);
-	*v_len = frag_len;
 
+	if ((b->flags & CAML_BA_FBSD_MASK) == 0 || proxy == NULL)
+		return netif_copy_to_mbuf(data, frag_len);
+
+	frag = NULL;
 	mp = &frag;
 	p = data;
 
@@ -609,16 +1239,21 @@ netif_map_to_mbuf(struct caml_ba_array *b, int v_off, int *v_len)
 			return NULL;
 		}
 
-		m->m_flags       |= M_EXT;
-		m->m_ext.ext_type = EXT_EXTREF;
-		m->m_ext.ext_buf  = (void *) p;
-		m->m_ext.ext_free = netif_mbuf_free;
-		m->m_ext.ext_arg1 = proxy;
-		m->m_ext.ext_arg2 = data;
-		m->m_ext.ref_cnt  = &proxy->refcount;
-		m->m_len          = min(MCLBYTES, frag_len);
-		m->m_data         = m->m_ext.ext_buf;
-		*(m->m_ext.ref_cnt) += 1;
+		/*
+		 * The external reference count is allocated by mbuf(9), as
+		 * drivers update it with 32-bit atomics.
+		 */
+		MEXTADD(m, p, min(MCLBYTES, frag_len), netif_mbuf_free, proxy,
+		    data, 0, EXT_MOD_TYPE);
+
+		if ((m->m_flags & M_EXT) == 0) {
+			m_free(m);
+			m_freem(frag);
+			return NULL;
+		}
+
+		netif_proxy_ref(proxy);
+		m->m_len = m->m_ext.ext_size;
 
 		frag_len -= m->m_len;
 		p += m->m_len;
@@ -629,60 +1264,163 @@ netif_map_to_mbuf(struct caml_ba_array *b, int v_off, int *v_len)
 	return frag;
 }
 
-CAMLprim value
-caml_put_mbufs(value id, value bufs)
+/*
+ * Map a list of Cstruct.t to a single packet in *pktp, or NULL if all of
+ * them are empty.  On failure, ENOMEM is returned and nothing is left
+ * allocated.
+ */
+static int
+netif_build_pkt(struct plugged_if *pip, value bufs, struct mbuf **pktp)
 {
-	CAMLparam2(id, bufs);
+	CAMLparam1(bufs);
 	CAMLlocal2(v, t);
-	struct plugged_if *pip;
 	struct mbuf **mp;
 	struct mbuf *frag;
 	struct mbuf *pkt;
 	struct caml_ba_array *b;
-	struct ifnet *ifp;
 	size_t pkt_len;
-	int v_off, v_len;
-	char bcast, real;
-	struct ether_header *eh;
+	long v_off, v_len;
 
-	if ((bufs == Val_emptylist) || (plugged == 0))
-		CAMLreturn(Val_unit);
-
-	pip = find_pi_by_index(Int_val(id));
-	if (pip == NULL)
-		CAMLreturn(Val_unit);
-
-	ifp = pip->pi_ifp;
+	pkt = NULL;
 	pkt_len = 0;
 	mp = &pkt;
 
-	while (bufs != Val_emptylist) {
+	for (; bufs != Val_emptylist; bufs = Field(bufs, 1)) {
 		t = Field(bufs, 0);
 		v = Field(t, 0);
-		v_off = Int_val(Field(t, 1));
-		v_len = Int_val(Field(t, 2));
 		b = Caml_ba_array_val(v);
-		frag = netif_map_to_mbuf(b, v_off, &v_len);
-		if (frag == NULL)
-			caml_failwith("No memory for mapping to mbuf");
+		v_off = Long_val(Field(t, 1));
+		/* Sub-arrays share the proxy of the whole run, use their size. */
+		v_len = lmin(b->dim[0] - v_off, Long_val(Field(t, 2)));
+		if (v_off < 0 || v_len <= 0)
+			continue;
+		frag = netif_map_to_mbuf(b, v_off, v_len);
+		if (frag == NULL) {
+			m_freem(pkt);
+			CAMLreturnT(int, ENOMEM);
+		}
 		*mp = frag;
-		mp = &(frag->m_next);
+		/* A fragment may span several mbufs. */
+		while (*mp != NULL)
+			mp = &((*mp)->m_next);
 		pkt_len += v_len;
-		bufs = Field(bufs, 1);
+	}
+
+	*pktp = pkt;
+
+	if (pkt == NULL)
+		CAMLreturnT(int, 0);
+
+	/*
+	 * The head was not allocated as a packet header, so clear all of it
+	 * before the offloads below and the driver look at the fields.
+	 */
+	if (m_pkthdr_init(pkt, M_NOWAIT) != 0) {
+		m_freem(pkt);
+		*pktp = NULL;
+		CAMLreturnT(int, ENOMEM);
 	}
 
 	pkt->m_flags       |= M_PKTHDR;
 	pkt->m_pkthdr.len   = pkt_len;
-	pkt->m_pkthdr.rcvif = ifp;
-	SLIST_INIT(&pkt->m_pkthdr.tags);
+	pkt->m_pkthdr.rcvif = pip->pi_ifp;
 
 	if (pkt->m_pkthdr.len > pip->pi_ifp->if_mtu)
 		printf("%s: Packet is greater (%d) than the MTU (%ld)\n",
 		    pip->pi_xname, pkt->m_pkthdr.len, pip->pi_ifp->if_mtu);
 
+	CAMLreturnT(int, 0);
+}
+
+/*
+ * Ask the driver to do the NETIF_TX_* work on a packet.  The TCP or UDP
+ * checksum field must already hold the sum of the pseudo-header (without
+ * the length for TSO), as the host stack does.  Only the offloads the
+ * interface advertises in if_hwassist may be requested.
+ */
+static int
+netif_tx_offload(struct plugged_if *pip, struct mbuf *pkt, int offload,
+    int tso_segsz)
+{
+	int csum;
+
+	csum = 0;
+
+	if (offload & NETIF_TX_CSUM_IP)
+		csum |= CSUM_IP;
+
+	if ((offload & (NETIF_TX_CSUM_TCP | NETIF_TX_CSUM_UDP)) ==
+	    (NETIF_TX_CSUM_TCP | NETIF_TX_CSUM_UDP))
+		return EINVAL;
+
+	if (offload & NETIF_TX_CSUM_TCP) {
+		csum |= CSUM_TCP;
+		pkt->m_pkthdr.csum_data = __offsetof(struct tcphdr, th_sum);
+	}
+
+	if (offload & NETIF_TX_CSUM_UDP) {
+		csum |= CSUM_UDP;
+		pkt->m_pkthdr.csum_data = __offsetof(struct udphdr, uh_sum);
+	}
+
+	if (offload & NETIF_TX_TSO) {
+		if ((offload & NETIF_TX_CSUM_TCP) == 0 || tso_segsz <= 0)
+			return EINVAL;
+		csum |= CSUM_TSO;
+		pkt->m_pkthdr.tso_segsz = tso_segsz;
+	}
+
+	if ((csum & ~pip->pi_ifp->if_hwassist) != 0)
+		return EOPNOTSUPP;
+
+	pkt->m_pkthdr.csum_flags |= csum;
+	return 0;
+}
+
+/*
+ * Nothing computes the offloaded checksums of a packet looped back to the
+ * host stack, so mark them as verified instead, like if_loop(4) does.
+ */
+static void
+netif_csum_local(struct mbuf *m)
+{
+	int csum;
+
+	csum = m->m_pkthdr.csum_flags;
+	m->m_pkthdr.csum_flags &= ~(CSUM_IP | CSUM_TCP | CSUM_UDP | CSUM_TSO);
+
+	if (csum & CSUM_IP)
+		m->m_pkthdr.csum_flags |= CSUM_IP_CHECKED | CSUM_IP_VALID;
+
+	if (csum & (CSUM_TCP | CSUM_UDP)) {
+		m->m_pkthdr.csum_flags |= CSUM_DATA_VALID | CSUM_PSEUDO_HDR;
+		m->m_pkthdr.csum_data = 0xffff;
+	}
+}
+
+/* Hand a packet over to the host stack, the driver, or both. */
+static void
+netif_send_pkt(struct plugged_if *pip, struct mbuf *pkt)
+{
+	struct ifnet *ifp;
+	struct ether_header *eh;
+	struct mbuf *m;
+	u_int slot;
+	char multi, real;
+
+	ifp = pip->pi_ifp;
 	eh = mtod(pkt, struct ether_header *);
-	real  = bcmp(eh->ether_dhost, pip->pi_lladdr, ETHER_ADDR_LEN) == 0;
-	bcast = bcmp(eh->ether_dhost, lladdr_all, ETHER_ADDR_LEN) == 0;
+	slot = netif_mac_hash(eh->ether_dhost);
+	multi = ETHER_IS_MULTICAST(eh->ether_dhost);
+	/*
+	 * Frames to another plugged interface of the port stay local.
+	 * Broadcast and multicast frames go both to the wire and through
+	 * if_input, which passes them on to the other members of the port
+	 * as well as the host.
+	 */
+	real  = bcmp(eh->ether_dhost, pip->pi_lladdr, ETHER_ADDR_LEN) == 0 ||
+	    (!multi &&
+	    netif_mac_lookup(pip->pi_port, eh->ether_dhost, &slot) != NULL);
 
 #ifdef NETIF_DEBUG
 	printf("Sending to: %02x:%02x:%02x:%02x:%02x:%02x (%04x), %s%s"
@@ -690,25 +1428,197 @@ caml_put_mbufs(value id, value bufs)
 	    eh->ether_dhost[0], eh->ether_dhost[1], eh->ether_dhost[2],
 	    eh->ether_dhost[3], eh->ether_dhost[4], eh->ether_dhost[5],
 	    ntohs(eh->ether_type),
-	    (real || bcast)  ? "[if_input]"  : "",
-	    (!real || bcast) ? "[if_output]" : "",
-	    (int) pkt_len);
+	    (real || multi)  ? "[if_input]"  : "",
+	    (!real || multi) ? "[if_output]" : "",
+	    pkt->m_pkthdr.len);
 #endif
 
+	pip->pi_tx_pkts++;
+	pip->pi_tx_bytes += pkt->m_pkthdr.len;
+
 	/* Sending to the real Ethernet address. */
-	if (real || bcast)
-		(ifp->if_input)(ifp,
-		    bcast ? m_copypacket(pkt, M_DONTWAIT) : pkt);
+	if (real || multi) {
+		m = multi ? m_copypacket(pkt, M_DONTWAIT) : pkt;
+		if (m != NULL) {
+			netif_csum_local(m);
+			(ifp->if_input)(ifp, m);
+		}
+	}
+
+	if (!real || multi)
+		if ((ifp->if_transmit)(ifp, pkt) != 0)
+			pip->pi_tx_errors++;
+}
+
+CAMLprim value
+caml_put_mbufs(value id, value bufs)
+{
+	CAMLparam2(id, bufs);
+	struct plugged_if *pip;
+	struct mbuf *pkt;
+
+	if ((bufs == Val_emptylist) || (plugged == 0))
+		CAMLreturn(Val_unit);
+
+	pip = find_pi_by_index(Int_val(id));
+	if (pip == NULL)
+		CAMLreturn(Val_unit);
 
-	if (!real || bcast)
-		(ifp->if_transmit)(ifp, pkt);
+	if (netif_build_pkt(pip, bufs, &pkt) != 0)
+		caml_failwith("No memory for mapping to mbuf");
+
+	if (pkt == NULL)
+		CAMLreturn(Val_unit);
+
+	pip->pi_tx_flushes++;
+	netif_send_pkt(pip, pkt);
 
 	CAMLreturn(Val_unit);
 }
 
+CAMLprim value
+caml_put_mbufs_offload(value id, value bufs, value offload, value tso_segsz)
+{
+	CAMLparam4(id, bufs, offload, tso_segsz);
+	struct plugged_if *pip;
+	struct mbuf *pkt;
+	int error;
+
+	if ((bufs == Val_emptylist) || (plugged == 0))
+		CAMLreturn(Val_unit);
+
+	pip = find_pi_by_index(Int_val(id));
+	if (pip == NULL)
+		CAMLreturn(Val_unit);
+
+	if (netif_build_pkt(pip, bufs, &pkt) != 0)
+		caml_failwith("No memory for mapping to mbuf");
+
+	if (pkt == NULL)
+		CAMLreturn(Val_unit);
+
+	error = netif_tx_offload(pip, pkt, Int_val(offload), Int_val(tso_segsz));
+	if (error != 0) {
+		m_freem(pkt);
+		caml_invalid_argument(error == EOPNOTSUPP ?
+		    "Offload not supported by the interface" :
+		    "Invalid offload request");
+	}
+
+	pip->pi_tx_flushes++;
+	netif_send_pkt(pip, pkt);
+
+	CAMLreturn(Val_unit);
+}
+
+/*
+ * Send a list of packets at once.  All the packets are mapped to mbufs
+ * first and chained through m_nextpkt, so that they are handed to the
+ * driver back to back without any OCaml allocation in between.
+ */
+CAMLprim value
+caml_put_mbufs_batch(value id, value pkts)
+{
+	CAMLparam2(id, pkts);
+	struct plugged_if *pip;
+	struct mbuf *head;
+	struct mbuf **mp;
+	struct mbuf *pkt;
+
+	if ((pkts == Val_emptylist) || (plugged == 0))
+		CAMLreturn(Val_unit);
+
+	pip = find_pi_by_index(Int_val(id));
+	if (pip == NULL)
+		CAMLreturn(Val_unit);
+
+	head = NULL;
+	mp = &head;
+
+	for (; pkts != Val_emptylist; pkts = Field(pkts, 1)) {
+		if (Field(pkts, 0) == Val_emptylist)
+			continue;
+		if (netif_build_pkt(pip, Field(pkts, 0), &pkt) != 0) {
+			while ((pkt = head) != NULL) {
+				head = pkt->m_nextpkt;
+				m_freem(pkt);
+			}
+			caml_failwith("No memory for mapping to mbuf");
+		}
+		if (pkt == NULL)
+			continue;
+		*mp = pkt;
+		mp = &(pkt->m_nextpkt);
+	}
+
+	if (head != NULL)
+		pip->pi_tx_flushes++;
+
+	while ((pkt = head) != NULL) {
+		head = pkt->m_nextpkt;
+		pkt->m_nextpkt = NULL;
+		netif_send_pkt(pip, pkt);
+	}
+
+	CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+caml_get_vif_stats(value id)
+{
+	CAMLparam1(id);
+	CAMLlocal1(result);
+	struct plugged_if *pip;
+
+	pip = find_pi_by_index(Int_val(id));
+
+	if (pip == NULL)
+		caml_failwith("No interface");
+
+	result = caml_alloc(5, 0);
+	Store_field(result, 0, Val_long(pip->pi_rx_drops));
+	Store_field(result, 1, Val_long(pip->pi_tx_flushes));
+	Store_field(result, 2, Val_long(pip->pi_tx_pkts));
+	Store_field(result, 3, Val_long(pip->pi_tx_bytes));
+	Store_field(result, 4, Val_long(pip->pi_tx_errors));
+	CAMLreturn(result);
+}
+
+CAMLprim value
+caml_get_offload_caps(value id)
+{
+	CAMLparam1(id);
+	struct plugged_if *pip;
+	struct ifnet *ifp;
+	int caps;
+
+	pip = find_pi_by_index(Int_val(id));
+
+	if (pip == NULL)
+		caml_failwith("No interface");
+
+	ifp = pip->pi_ifp;
+	caps = 0;
+
+	if (ifp->if_hwassist & CSUM_IP)
+		caps |= NETIF_TX_CSUM_IP;
+	if (ifp->if_hwassist & CSUM_TCP)
+		caps |= NETIF_TX_CSUM_TCP;
+	if (ifp->if_hwassist & CSUM_UDP)
+		caps |= NETIF_TX_CSUM_UDP;
+	if (ifp->if_hwassist & CSUM_TSO)
+		caps |= NETIF_TX_TSO;
+	if (ifp->if_capenable & IFCAP_RXCSUM)
+		caps |= NETIF_CAP_RXCSUM;
+
+	CAMLreturn(Val_int(caps));
+}
+
 void
 netif_init(void)
 {
+	rm_init(&pi_lock, "plugged_if");
+
 	prev_ng_ether_input_p = ng_ether_input_p;
 	ng_ether_input_p = netif_ether_input;
 
@@ -729,8 +1639,8 @@ void
 netif_deinit(void)
 {
 	struct plugged_if *p1, *p2;
+	struct netif_port *npp;
 	struct ifnet *ifp;
-	struct mbuf_entry *e1, *e2;
 
 	ng_ether_input_p        = prev_ng_ether_input_p;
 	ng_ether_input_orphan_p = prev_ng_ether_input_orphan_p;
@@ -738,30 +1648,34 @@ netif_deinit(void)
 	ng_ether_attach_p       = prev_ng_ether_attach_p;
 	ng_ether_detach_p       = prev_ng_ether_detach_p;
 
+	/*
+	 * Wait for the receivers that are still running, and unlink
+	 * everything so that a late one finds nothing to deliver to.
+	 */
+	rm_wlock(&pi_lock);
 	p1 = TAILQ_FIRST(&pihead);
+	TAILQ_INIT(&pihead);
+	bzero(pi_by_index, sizeof(pi_by_index));
+	bzero(port_by_llindex, sizeof(port_by_llindex));
+	plugged = 0;
+	rm_wunlock(&pi_lock);
+
+	/* Every port is freed along with its last plugged interface. */
 	while (p1 != NULL) {
 		p2  = TAILQ_NEXT(p1, pi_next);
+		npp = p1->pi_port;
 		ifp = p1->pi_ifp;
 		IFNET_WLOCK();
 		if (IFP2AC(ifp)->ac_netgraph == (void *) 1)
 			IFP2AC(ifp)->ac_netgraph = (void *) 0;
 		IFNET_WUNLOCK();
-		mtx_lock(&p1->pi_rx_lock);
-		e1 = LIST_FIRST(&p1->pi_rx_head);
-		while (e1 != NULL) {
-			e2 = LIST_NEXT(e1, me_next);
-			m_freem(e1->me_m);
-			__free(e1);
-			e1 = e2;
-		}
-#ifdef NETIF_DEBUG
-		p1->pi_rx_qlen = 0;
-#endif
-		LIST_INIT(&p1->pi_rx_head);
-		mtx_unlock(&p1->pi_rx_lock);
+		netif_rx_flush(p1);
+		buf_ring_free(p1->pi_rx_ring, M_DEVBUF);
+		TAILQ_REMOVE(&npp->np_vifs, p1, pi_port_next);
+		if (TAILQ_EMPTY(&npp->np_vifs))
+			__free(npp);
 		__free(p1);
-		plugged--;
 		p1 = p2;
 	}
-	TAILQ_INIT(&pihead);
+	rm_destroy(&pi_lock);
 }
@@ -26,10 +26,22 @@
  */
 
 #include <sys/types.h>
+#include <sys/param.h>
+#include <sys/errno.h>
 #include <sys/malloc.h>
 #include <sys/kernel.h>
+#include <sys/systm.h>
+#include <sys/lock.h>
+#include <sys/mutex.h>
+#include <sys/queue.h>
+#include <sys/pcpu.h>
 #include <sys/sdt.h>
 
+#include <vm/vm.h>
+#include <vm/pmap.h>
+#include <machine/atomic.h>
+#include <machine/vmparam.h>
+
 #include "caml/misc.h"
 #include "caml/mlvalues.h"
 #include "caml/memory.h"
@@ -38,22 +50,503 @@
 #include "caml/bigarray.h"
 
 
+/*
+ * Io-pages come from a pool of physically contiguous slabs, reserved at
+ * load time and added on demand, which are carved with a buddy allocator:
+ * runs of 2^order pages wait on per-order free lists, they are split when
+ * a smaller run is needed and merged with their buddy when freed.  Larger
+ * requests go to contigmalloc(9) directly.  A run returns to the pool when
+ * the last Bigarray or mbuf referring to it is gone.
+ */
+#define IOPAGE_MAX_ORDER	9
+#define IOPAGE_SLAB_PAGES	(1 << IOPAGE_MAX_ORDER)
+#define IOPAGE_SLAB_SIZE	(PAGE_SIZE * IOPAGE_SLAB_PAGES)
+
+/* Slabs reserved at load time, see the "mirage.iopage.slabs" variable. */
+#define IOPAGE_RESERVE		4
+
+/*
+ * With "mirage.iopage.superpages" set, slabs are aligned on 2MB, and on
+ * amd64 they are used through the direct map, which maps them with a
+ * single superpage each.  Large buffers then need far fewer TLB entries.
+ */
+static int iopage_superpages;
+
+/*
+ * Single pages are also kept in per-CPU caches, so that most allocations
+ * and frees touch neither the pool lock nor the cache lines of other CPUs.
+ * The caches are refilled from and flushed to the pool by batches.
+ */
+#define IOPAGE_CACHE_SIZE	64
+#define IOPAGE_CACHE_BATCH	(IOPAGE_CACHE_SIZE / 2)
+
+struct iopage_slab;
+
+struct iopage_proxy {
+	struct caml_ba_proxy	ip_proxy;	/* Must be first */
+	struct iopage_slab	*ip_slab;	/* NULL if not from the pool */
+	int			ip_order;
+};
+
+/* Header of a free run, kept in its first page. */
+struct iopage_free {
+	LIST_ENTRY(iopage_free)	if_next;
+	struct iopage_slab	*if_slab;
+};
+
+struct iopage_slab {
+	LIST_ENTRY(iopage_slab)	is_next;
+	char			*is_base;	/* Address the pages are used at */
+	char			*is_kva;	/* Address from contigmalloc(9) */
+	/* Order + 1 of the free run starting at each page, or 0. */
+	u_char			is_free[IOPAGE_SLAB_PAGES];
+	/* Proxy of the allocated run starting at each page. */
+	struct iopage_proxy	is_proxy[IOPAGE_SLAB_PAGES];
+};
+
+static LIST_HEAD(, iopage_slab) iopage_slabs =
+    LIST_HEAD_INITIALIZER(iopage_slabs);
+static LIST_HEAD(, iopage_free) iopage_free[IOPAGE_MAX_ORDER + 1];
+static int iopage_nslabs;
+
+struct iopage_cache {
+	int			ic_count;
+	struct iopage_proxy	*ic_pages[IOPAGE_CACHE_SIZE];
+	u_long			ic_hits;
+	u_long			ic_misses;
+} __aligned(CACHE_LINE_SIZE);
+
+/* Only used by their CPU, within a critical section. */
+static struct iopage_cache iopage_caches[MAXCPU];
+
+/* Protects the slabs and the free lists, runs are freed by any thread. */
+static struct mtx iopage_lock;
+
+/* Runs and large buffers handed out and not released yet. */
+static volatile u_int iopage_live;
+
+void iopage_init(void);
+void iopage_deinit(void);
 CAMLprim value caml_alloc_pages(value n_pages);
+CAMLprim value caml_iopage_stats(value v_unit);
+
+static struct iopage_slab *
+iopage_slab_alloc(void)
+{
+	struct iopage_slab *slab;
+
+	slab = malloc(sizeof(struct iopage_slab));
+
+	if (slab == NULL)
+		return NULL;
+
+	slab->is_kva = contigmalloc(IOPAGE_SLAB_SIZE, M_NOWAIT, 0,
+	    0xffffffff, iopage_superpages ? IOPAGE_SLAB_SIZE : PAGE_SIZE, 0ul);
+
+	if (slab->is_kva == NULL) {
+		free(slab);
+		return NULL;
+	}
+
+	slab->is_base = slab->is_kva;
+#ifdef __amd64__
+	if (iopage_superpages)
+		slab->is_base = (char *) PHYS_TO_DMAP(vtophys(slab->is_kva));
+#endif
+
+	bzero(slab->is_free, sizeof(slab->is_free));
+	return slab;
+}
+
+static void
+iopage_free_insert(struct iopage_slab *slab, int idx, int order)
+{
+	struct iopage_free *f;
+
+	f = (struct iopage_free *) (slab->is_base + ptoa(idx));
+	f->if_slab = slab;
+	slab->is_free[idx] = order + 1;
+	LIST_INSERT_HEAD(&iopage_free[order], f, if_next);
+}
+
+static void
+iopage_free_remove(struct iopage_slab *slab, int idx)
+{
+	struct iopage_free *f;
+
+	f = (struct iopage_free *) (slab->is_base + ptoa(idx));
+	slab->is_free[idx] = 0;
+	LIST_REMOVE(f, if_next);
+}
+
+/* Hand a new slab to the pool as a single free run. */
+static void
+iopage_slab_add(struct iopage_slab *slab)
+{
+	mtx_assert(&iopage_lock, MA_OWNED);
+
+	LIST_INSERT_HEAD(&iopage_slabs, slab, is_next);
+	iopage_nslabs++;
+	iopage_free_insert(slab, 0, IOPAGE_MAX_ORDER);
+}
+
+/* Add a slab to the pool, it is allocated without iopage_lock held. */
+static int
+iopage_grow(void)
+{
+	struct iopage_slab *slab;
+
+	slab = iopage_slab_alloc();
+
+	if (slab == NULL)
+		return ENOMEM;
+
+	mtx_lock(&iopage_lock);
+	iopage_slab_add(slab);
+	mtx_unlock(&iopage_lock);
+	return 0;
+}
+
+/* Take a run from the free lists, or NULL if the pool has to grow. */
+static struct iopage_proxy *
+iopage_buddy_alloc(int order)
+{
+	struct iopage_slab *slab;
+	struct iopage_free *f;
+	int idx, o;
+
+	mtx_assert(&iopage_lock, MA_OWNED);
+
+	for (o = order; o <= IOPAGE_MAX_ORDER; o++)
+		if (!LIST_EMPTY(&iopage_free[o]))
+			break;
+
+	if (o > IOPAGE_MAX_ORDER)
+		return NULL;
+
+	f = LIST_FIRST(&iopage_free[o]);
+	slab = f->if_slab;
+	idx = atop((char *) f - slab->is_base);
+	iopage_free_remove(slab, idx);
+
+	/* Give back upper halves until the run has the requested size. */
+	while (o > order) {
+		o--;
+		iopage_free_insert(slab, idx + (1 << o), o);
+	}
+
+	slab->is_proxy[idx].ip_slab  = slab;
+	slab->is_proxy[idx].ip_order = order;
+	return &slab->is_proxy[idx];
+}
+
+static void
+iopage_buddy_free(struct iopage_proxy *ip)
+{
+	struct iopage_slab *slab;
+	int idx, order, buddy;
+
+	mtx_assert(&iopage_lock, MA_OWNED);
+
+	slab = ip->ip_slab;
+	idx = ip - slab->is_proxy;
+	order = ip->ip_order;
+
+	while (order < IOPAGE_MAX_ORDER) {
+		buddy = idx ^ (1 << order);
+
+		if (slab->is_free[buddy] != order + 1)
+			break;
+
+		iopage_free_remove(slab, buddy);
+		idx &= ~(1 << order);
+		order++;
+	}
+	iopage_free_insert(slab, idx, order);
+}
+
+static struct iopage_proxy *
+iopage_cache_get(void)
+{
+	struct iopage_proxy *batch[IOPAGE_CACHE_BATCH];
+	struct iopage_proxy *ip;
+	struct iopage_cache *ic;
+	int n;
+
+	critical_enter();
+	ic = &iopage_caches[curcpu];
+
+	if (ic->ic_count > 0) {
+		ip = ic->ic_pages[--ic->ic_count];
+		ic->ic_hits++;
+		critical_exit();
+		return ip;
+	}
+
+	ic->ic_misses++;
+	critical_exit();
+
+	n = 0;
+	mtx_lock(&iopage_lock);
+	for (;;) {
+		while (n < IOPAGE_CACHE_BATCH &&
+		    (ip = iopage_buddy_alloc(0)) != NULL)
+			batch[n++] = ip;
+
+		if (n > 0)
+			break;
+
+		mtx_unlock(&iopage_lock);
+
+		if (iopage_grow() != 0)
+			return NULL;
+
+		mtx_lock(&iopage_lock);
+	}
+	mtx_unlock(&iopage_lock);
+
+	/* We may run on another CPU by now, which is fine. */
+	ip = batch[--n];
+	critical_enter();
+	ic = &iopage_caches[curcpu];
+	while (n > 0 && ic->ic_count < IOPAGE_CACHE_SIZE)
+		ic->ic_pages[ic->ic_count++] = batch[--n];
+	critical_exit();
+
+	if (n > 0) {
+		mtx_lock(&iopage_lock);
+		while (n > 0)
+			iopage_buddy_free(batch[--n]);
+		mtx_unlock(&iopage_lock);
+	}
+
+	return ip;
+}
+
+static void
+iopage_cache_put(struct iopage_proxy *ip)
+{
+	struct iopage_proxy *batch[IOPAGE_CACHE_BATCH];
+	struct iopage_cache *ic;
+	int n;
+
+	critical_enter();
+	ic = &iopage_caches[curcpu];
+
+	if (ic->ic_count < IOPAGE_CACHE_SIZE) {
+		ic->ic_pages[ic->ic_count++] = ip;
+		critical_exit();
+		return;
+	}
+
+	/* Full, hand the oldest half back to the pool. */
+	for (n = 0; n < IOPAGE_CACHE_BATCH; n++)
+		batch[n] = ic->ic_pages[n];
+	ic->ic_count -= IOPAGE_CACHE_BATCH;
+	bcopy(&ic->ic_pages[IOPAGE_CACHE_BATCH], &ic->ic_pages[0],
+	    ic->ic_count * sizeof(ic->ic_pages[0]));
+	ic->ic_pages[ic->ic_count++] = ip;
+	critical_exit();
+
+	mtx_lock(&iopage_lock);
+	while (n > 0)
+		iopage_buddy_free(batch[--n]);
+	mtx_unlock(&iopage_lock);
+}
+
+static void
+iopage_release(struct caml_ba_proxy *proxy)
+{
+	struct iopage_proxy *ip;
+
+	ip = (struct iopage_proxy *) proxy;
+	atomic_subtract_int(&iopage_live, 1);
+
+	if (ip->ip_slab == NULL) {
+		contigfree(proxy->data, proxy->size);
+		free(ip);
+		return;
+	}
+
+	if (ip->ip_order == 0) {
+		iopage_cache_put(ip);
+		return;
+	}
+
+	mtx_lock(&iopage_lock);
+	iopage_buddy_free(ip);
+	mtx_unlock(&iopage_lock);
+}
+
+static struct iopage_proxy *
+iopage_alloc(int order)
+{
+	struct iopage_proxy *ip;
+
+	if (order == 0)
+		ip = iopage_cache_get();
+	else {
+		mtx_lock(&iopage_lock);
+		while ((ip = iopage_buddy_alloc(order)) == NULL) {
+			mtx_unlock(&iopage_lock);
+
+			if (iopage_grow() != 0)
+				return NULL;
+
+			mtx_lock(&iopage_lock);
+		}
+		mtx_unlock(&iopage_lock);
+	}
+
+	if (ip == NULL)
+		return NULL;
+
+	ip->ip_proxy.refcount = 1;
+	ip->ip_proxy.data     = ip->ip_slab->is_base +
+	    ptoa(ip - ip->ip_slab->is_proxy);
+	ip->ip_proxy.size     = ptoa(1 << order);
+	ip->ip_proxy.release  = iopage_release;
+	atomic_add_int(&iopage_live, 1);
+	return ip;
+}
+
+static struct iopage_proxy *
+iopage_alloc_large(size_t size)
+{
+	struct iopage_proxy *ip;
+
+	ip = malloc(sizeof(struct iopage_proxy));
+
+	if (ip == NULL)
+		return NULL;
+
+	ip->ip_proxy.data = contigmalloc(size, M_NOWAIT, 0, 0xffffffff,
+	    PAGE_SIZE, 0ul);
+
+	if (ip->ip_proxy.data == NULL) {
+		free(ip);
+		return NULL;
+	}
+
+	ip->ip_proxy.refcount = 1;
+	ip->ip_proxy.size     = size;
+	ip->ip_proxy.release  = iopage_release;
+	ip->ip_slab           = NULL;
+	ip->ip_order          = -1;
+	atomic_add_int(&iopage_live, 1);
+	return ip;
+}
+
+void
+iopage_init(void)
+{
+	int i, reserve;
+
+	mtx_init(&iopage_lock, "iopage", NULL, MTX_DEF);
+
+	for (i = 0; i <= IOPAGE_MAX_ORDER; i++)
+		LIST_INIT(&iopage_free[i]);
+
+	reserve = IOPAGE_RESERVE;
+	getenv_int("mirage.iopage.slabs", &reserve);
+	getenv_int("mirage.iopage.superpages", &iopage_superpages);
+
+	for (i = 0; i < reserve; i++)
+		if (iopage_grow() != 0)
+			break;
+}
+
+/*
+ * Runs may still be referenced by mbufs on their way out, so give them a
+ * second to be released.  Any other reference is held by the OCaml heap,
+ * which is torn down without running the finalisers: those runs never
+ * return, and the slabs holding them are left allocated.
+ */
+void
+iopage_deinit(void)
+{
+	struct iopage_slab *slab, *next;
+	struct iopage_cache *ic;
+	int i, busy;
+
+	for (i = 0; iopage_live > 0 && i < 10; i++)
+		pause("iopage", hz / 10);
+
+	/* Merge the cached pages back, so that free slabs are whole again. */
+	mtx_lock(&iopage_lock);
+	CPU_FOREACH(i) {
+		ic = &iopage_caches[i];
+		while (ic->ic_count > 0)
+			iopage_buddy_free(ic->ic_pages[--ic->ic_count]);
+	}
+	mtx_unlock(&iopage_lock);
+
+	busy = 0;
+	LIST_FOREACH_SAFE(slab, &iopage_slabs, is_next, next) {
+		LIST_REMOVE(slab, is_next);
+		if (slab->is_free[0] != IOPAGE_MAX_ORDER + 1) {
+			busy++;
+			continue;
+		}
+		contigfree(slab->is_kva, IOPAGE_SLAB_SIZE);
+		free(slab);
+	}
+
+	if (iopage_live > 0)
+		printf("iopage: leaking %u buffers still in use (%d slabs).\n",
+		    iopage_live, busy);
+
+	iopage_nslabs = 0;
+	bzero(iopage_caches, sizeof(iopage_caches));
+	mtx_destroy(&iopage_lock);
+}
+
 
 CAMLprim value
 caml_alloc_pages(value n_pages)
 {
 	CAMLparam1(n_pages);
 	CAMLlocal1(result);
+	struct iopage_proxy *ip;
 	size_t len;
-	unsigned long block;
+	int order;
+
+	len = Long_val(n_pages);
+	order = (len > 1) ? fls(len - 1) : 0;
 
-	len = Int_val(n_pages);
-	block = (unsigned long) contigmalloc(PAGE_SIZE * len, M_NOWAIT, 0,
-	    0xffffffff, PAGE_SIZE, 0ul);
-	if (block == 0)
+	/*
+	 * Allocate the Bigarray first, as that may raise, and let it map the
+	 * pages only once they are there.  Collect about once per pool worth
+	 * of pages, so that they return.
+	 */
+	result = caml_ba_alloc_fbsd(CAML_BA_UINT8 | CAML_BA_C_LAYOUT |
+	    CAML_BA_FBSD_IOPAGE, PAGE_SIZE * len,
+	    IOPAGE_SLAB_SIZE * max(iopage_nslabs, 1));
+	ip = (order <= IOPAGE_MAX_ORDER) ? iopage_alloc(order) :
+	    iopage_alloc_large(PAGE_SIZE * len);
+	if (ip == NULL)
 		caml_failwith("contigmalloc");
-	result = caml_ba_alloc_dims(CAML_BA_UINT8 | CAML_BA_C_LAYOUT
-	    /*| CAML_BA_FBSD_IOPAGE*/, 1, (void *) block, (long) PAGE_SIZE * len);
+	caml_ba_fbsd_attach(result, &ip->ip_proxy, ip->ip_proxy.data);
+	CAMLreturn(result);
+}
+
+CAMLprim value
+caml_iopage_stats(value v_unit)
+{
+	CAMLparam1(v_unit);
+	CAMLlocal1(result);
+	u_long hits, misses;
+	int i;
+
+	hits = misses = 0;
+	CPU_FOREACH(i) {
+		hits   += iopage_caches[i].ic_hits;
+		misses += iopage_caches[i].ic_misses;
+	}
+
+	result = caml_alloc(3, 0);
+	Store_field(result, 0, Val_long(hits));
+	Store_field(result, 1, Val_long(misses));
+	Store_field(result, 2, Val_int(iopage_nslabs));
 	CAMLreturn(result);
 }
@@ -16,32 +16,39 @@
 
 type t = (char, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t
 
+type stats = {
+  cache_hits: int;
+  cache_misses: int;
+  slabs: int;
+}
+
 external alloc_pages: int -> t = "caml_alloc_pages"
+external get_stats: unit -> stats = "caml_iopage_stats"
 
 let page_size = 1 lsl 12
 
 let length t = Bigarray.Array1.dim t
 
-let cache = Stack.create ()
-
+(* Pages return to the pool of the kernel module when they are finalised,
+   so a full major collection makes room for a failed allocation. *)
 let get_unsafe n =
   try alloc_pages n with _ ->
-    Gc.compact ();
+    Gc.full_major ();
     try alloc_pages n with _ -> raise Out_of_memory
 
 let get = function
   | n when n < 1 ->
     raise (Invalid_argument "The number of page should be greater or equal to 1")
-  | 1 -> if Stack.is_empty cache then get_unsafe 1 else Stack.pop cache
   | n -> get_unsafe n
 
 let recycle frame =
   if Bigarray.Array1.dim frame <> page_size
   then raise (Invalid_argument "block size is not 4096 and therefore cannot be recycled")
-  else Stack.push frame cache
 
 let get_order order = get (1 lsl order)
 
+let stats () = get_stats ()
+
 let to_pages t =
   assert ((length t) mod page_size == 0);
   let rec loop off acc =
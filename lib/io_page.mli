@@ -27,6 +27,16 @@ val get : int -> t
 (** [get_order i] is [get (1 lsl i)]. *)
 val get_order : int -> t
 
+(** Counters of the page allocator of the kernel module. *)
+type stats = {
+  cache_hits: int;    (** Single pages taken from a per-CPU cache *)
+  cache_misses: int;  (** Per-CPU cache refills from the shared pool *)
+  slabs: int;         (** Contiguous 2MB slabs held by the pool *)
+}
+
+(** [stats ()] is the current value of the page allocator counters. *)
+val stats : unit -> stats
+
 (** [pages_order i] is [pages (1 lsl i)]. *)
 val pages_order : int -> t list
 
@@ -49,6 +59,7 @@ val string_blit : string -> int -> t -> int -> int -> unit
 val blit : t -> t -> unit
 
 val recycle : t -> unit
-(** [recycle block] puts [block] into the stack of reusable pages if
-    the size of [block] is exactly one page, or raise
-    [Invalid_argument] otherwise. *)
+(** [recycle block] does nothing if the size of [block] is exactly
+    one page, or raise [Invalid_argument] otherwise.  Blocks return to
+    the page pool by themselves once neither OCaml nor the network
+    stack refers to them. *)
@@ -29,6 +29,24 @@ open Lwt
 
 external block_kernel : float -> unit = "caml_block_kernel"
 
+(* Phases of the scheduler loop, in the order of enum sched_phase in
+   kmod.c.  Each probe accounts the cycles since the previous one to the
+   phase named; see sysctl debug.mirage_sched. *)
+type phase =
+  | Loop
+  | Wakeup_paused
+  | Restart_threads
+  | Poll
+  | Select_next
+  | Block_kernel
+  | Activations
+
+external probe : phase -> unit = "caml_sched_probe" "noalloc"
+
+(* Reads the state of the Mirage kernel thread, false once the module is
+   being unloaded. *)
+external kthread_running : unit -> bool = "caml_kthread_running" "noalloc"
+
 let enter_hooks = Lwt_sequence.create ()
 let exit_hooks  = Lwt_sequence.create ()
 
@@ -49,30 +67,42 @@ let rec call_hooks hooks =
 let run t =
   let t = call_hooks enter_hooks <&> t in
   let rec aux () =
+    probe Loop;
     Lwt.wakeup_paused ();
+    probe Wakeup_paused;
     Time.restart_threads Clock.time;
+    probe Restart_threads;
+    match Lwt.poll t with
+    | Some _ -> probe Poll
+    | None   ->
+      probe Poll;
+      let timeout =
+        match Time.select_next Clock.time with
+        | None    -> 86400000.000
+        | Some tm -> tm
+      in
+      probe Select_next;
+      block_kernel timeout;
+      probe Block_kernel;
+      Activations.run ();
+      probe Activations;
+      if kthread_running () then aux ()
+  in
+  (* The whole scheduler loop runs in here, and it returns to the kernel
+     thread only when t has completed or the module is being unloaded. *)
+  let main () =
     try
-      match Lwt.poll t with
-      | Some _ -> true
-      | None   ->
-        let timeout =
-          match Time.select_next Clock.time with
-          | None    -> 86400000.000
-          | Some tm -> tm
-        in
-        block_kernel timeout;
-        false
+      aux ()
     with exn ->
       (let t   = Printexc.to_string exn in
        let msg = Printf.sprintf "Top-level exception: \"%s\"!" t in
-       prerr_endline msg;
-      true)
+       prerr_endline msg)
   in
   let finalize () =
     Lwt.cancel t;
     Gc.compact ()
   in
-  ignore (Callback.register "OS.Main.run" aux);
+  ignore (Callback.register "OS.Main.run" main);
   ignore (Callback.register "OS.Main.finalize" finalize)
 
 let () = at_exit (fun () -> run (call_hooks exit_hooks))
@@ -37,6 +37,48 @@ type t = {
 
 type id = string
 
+type stats = {
+  rx_drops: int;
+  tx_flushes: int;
+  tx_pkts: int;
+  tx_bytes: int;
+  tx_errors: int;
+}
+
+type tx_offload = {
+  csum_ip: bool;
+  csum_tcp: bool;
+  csum_udp: bool;
+  tso_segsz: int;
+}
+
+type rx_csum = {
+  ip_ok: bool;
+  l4_ok: bool;
+}
+
+type offload_caps = {
+  tx_csum_ip: bool;
+  tx_csum_tcp: bool;
+  tx_csum_udp: bool;
+  tx_tso: bool;
+  rx_csum: bool;
+}
+
+let no_offload = {
+  csum_ip = false; csum_tcp = false; csum_udp = false; tso_segsz = 0
+}
+
+(* Keep these in sync with NETIF_TX_*, NETIF_RX_CSUM_* and
+   NETIF_CAP_* in netif_stubs.c *)
+let tx_csum_ip  = 0x01
+let tx_csum_tcp = 0x02
+let tx_csum_udp = 0x04
+let tx_tso      = 0x08
+let rx_csum_ip  = 0x01
+let rx_csum_l4  = 0x02
+let cap_rxcsum  = 0x10
+
 let id_of_string s = s
 let string_of_id i = i
 
@@ -44,10 +86,18 @@ let id t = t.backend
 
 external get_vifs: unit -> id list = "caml_get_vifs"
 external plug_vif: id -> int -> string -> bool = "caml_plug_vif"
-external unplug_vif: id -> unit = "caml_unplug_vif"
-external get_mbufs     : int -> Cstruct.t list = "caml_get_mbufs"
+external unplug_vif: int -> unit = "caml_unplug_vif"
+external vif_join_group: int -> string -> unit = "caml_vif_join_group"
+external vif_leave_group: int -> string -> unit = "caml_vif_leave_group"
+external get_mbuf_batch : int -> int -> Cstruct.t array = "caml_get_mbuf_batch"
 external get_next_mbuf : int -> Cstruct.t option = "caml_get_next_mbuf"
+external get_next_mbuf_frags : int -> Cstruct.t list option = "caml_get_next_mbuf_frags"
 external put_mbufs     : int -> Cstruct.t list -> unit = "caml_put_mbufs"
+external put_mbufs_batch : int -> Cstruct.t list list -> unit = "caml_put_mbufs_batch"
+external get_vif_stats : int -> stats = "caml_get_vif_stats"
+external get_next_mbuf_csum : int -> (Cstruct.t * int) option = "caml_get_next_mbuf_csum"
+external put_mbufs_offload : int -> Cstruct.t list -> int -> int -> unit = "caml_put_mbufs_offload"
+external get_offload_caps : int -> int = "caml_get_offload_caps"
 
 let devices : (id, t) Hashtbl.t = Hashtbl.create 1
 let did = ref 1
@@ -80,26 +130,27 @@ let mac_generator i =
   t.(5) <- i land 0xFF;
   t
 
+let add_vif id =
+  let backend = id in
+  let backend_id = !did in
+  let mac = Macaddr.make_local (fun i -> (mac_generator backend_id).(i)) in
+  let active = plug_vif id backend_id (Macaddr.to_bytes mac) in
+  let t = { backend_id; backend; mac; active } in
+  Hashtbl.add devices id t;
+  did := (!did + 1) land 0xFF;
+  return t
+
 let plug id =
   try
     return (Hashtbl.find devices id)
-  with Not_found ->
-    let backend = id in
-    let backend_id = !did in
-    let mac = Macaddr.make_local (fun i -> (mac_generator backend_id).(i)) in
-    let active = plug_vif id backend_id (Macaddr.to_bytes mac) in
-    let t = { backend_id; backend; mac; active } in
-    Hashtbl.add devices id t;
-    did := (!did + 1) land 0xFF;
-    return t
+  with Not_found -> add_vif id
 
 let unplug id =
- try
-   let t = Hashtbl.find devices id in
-   t.active <- false;
-   Hashtbl.remove devices id;
-   unplug_vif id
- with Not_found -> ()
+  List.iter (fun t ->
+    t.active <- false;
+    Hashtbl.remove devices id;
+    unplug_vif t.backend_id)
+    (Hashtbl.find_all devices id)
 
 let create () =
   lwt ids = enumerate () in
@@ -113,30 +164,89 @@ let writev ifc bufs =
 
 let write ifc buf = writev ifc [buf]
 
-let rec input ifc =
-  let next = get_next_mbuf ifc.backend_id in
-  match next with
-  | None       ->
-    Time.yield () >>
-    input ifc
-  | Some frame -> return frame
+let writev_batch ifc pkts =
+  put_mbufs_batch (ifc.backend_id) pkts;
+  return ()
+
+let writev_offload ifc off bufs =
+  let bit b v = if b then v else 0 in
+  let flags =
+    bit off.csum_ip tx_csum_ip lor
+    bit off.csum_tcp tx_csum_tcp lor
+    bit off.csum_udp tx_csum_udp lor
+    bit (off.tso_segsz > 0) tx_tso in
+  put_mbufs_offload (ifc.backend_id) bufs flags off.tso_segsz;
+  return ()
 
-let rec listen ifc fn =
+let get_stats ifc = get_vif_stats ifc.backend_id
+
+let offload_caps ifc =
+  let caps = get_offload_caps ifc.backend_id in
+  let has v = caps land v <> 0 in
+  { tx_csum_ip = has tx_csum_ip; tx_csum_tcp = has tx_csum_tcp;
+    tx_csum_udp = has tx_csum_udp; tx_tso = has tx_tso;
+    rx_csum = has cap_rxcsum }
+
+(* Wait until [dequeue] finds something on the interface. *)
+let rec wait_for dequeue ifc =
+  match dequeue ifc.backend_id with
+  | None   ->
+    Activations.wait () >>
+    wait_for dequeue ifc
+  | Some x -> return x
+
+(* The receive loop of every listen function, [input] takes what is
+   handed to [fn] on each turn. *)
+let rec receive input ifc fn =
   match ifc.active with
   | true ->
     begin
       try_lwt
-        lwt frame = input ifc in
-        fn frame;
+        lwt x = input ifc in
+        fn x;
         Time.yield () >>
-        listen ifc fn
+        receive input ifc fn
       with exn ->
         return (printf "EXN: %s, bt: %s\n%!"
           (Printexc.to_string exn) (Printexc.get_backtrace ()));
-        listen ifc fn
+        receive input ifc fn
     end;
   | false -> return ()
 
+let input ifc = wait_for get_next_mbuf ifc
+
+let input_frags ifc = wait_for get_next_mbuf_frags ifc
+
+let input_csum ifc =
+  wait_for get_next_mbuf_csum ifc >|= fun (frame, flags) ->
+  (frame, { ip_ok = flags land rx_csum_ip <> 0;
+            l4_ok = flags land rx_csum_l4 <> 0 })
+
+(* Maximum number of frames taken from the kernel at once. *)
+let rx_batch = 64
+
+let input_batch ifc =
+  wait_for (fun id ->
+    match get_mbuf_batch id rx_batch with
+    | [||]   -> None
+    | frames -> Some frames) ifc
+
+let listen_frags ifc fn = receive input_frags ifc fn
+
+let listen_csum ifc fn =
+  receive input_csum ifc (fun (frame, csum) -> fn frame csum)
+
+let listen_batch ifc fn = receive input_batch ifc fn
+
+let listen ifc fn =
+  listen_batch ifc (fun frames ->
+    Array.iter (fun frame -> ignore (fn frame)) frames;
+    return ())
+
+let join_group ifc mac = vif_join_group ifc.backend_id (Macaddr.to_bytes mac)
+
+let leave_group ifc mac = vif_leave_group ifc.backend_id (Macaddr.to_bytes mac)
+
 let ethid ifc = string_of_int ifc.backend_id
 
 let mac ifc = ifc.mac
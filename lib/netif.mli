@@ -26,6 +26,44 @@ type id
 val id_of_string: string -> id
 val string_of_id: id -> string
 
+(** Counters kept by the kernel for an interface. *)
+type stats = {
+  rx_drops: int;    (** Frames dropped because the RX queue was full *)
+  tx_flushes: int;  (** Number of times packets were handed to the driver *)
+  tx_pkts: int;     (** Packets sent *)
+  tx_bytes: int;    (** Bytes sent *)
+  tx_errors: int;   (** Packets refused by the driver *)
+}
+
+(** Work left to the hardware on an outgoing packet.  For TCP and UDP
+    checksums, the checksum field must already hold the checksum of the
+    pseudo-header, which must not include the length for TSO. *)
+type tx_offload = {
+  csum_ip: bool;    (** Compute the IPv4 header checksum *)
+  csum_tcp: bool;   (** Compute the TCP checksum *)
+  csum_udp: bool;   (** Compute the UDP checksum *)
+  tso_segsz: int;   (** Split the TCP payload in segments of this size
+                        if positive, [csum_tcp] must be set as well *)
+}
+
+(** Checksums of a received frame verified by the hardware. *)
+type rx_csum = {
+  ip_ok: bool;      (** The IPv4 header checksum is correct *)
+  l4_ok: bool;      (** The TCP or UDP checksum is correct *)
+}
+
+(** Offloads supported by an interface. *)
+type offload_caps = {
+  tx_csum_ip: bool;
+  tx_csum_tcp: bool;
+  tx_csum_udp: bool;
+  tx_tso: bool;
+  rx_csum: bool;
+}
+
+(** No work left to the hardware. *)
+val no_offload : tx_offload
+
 (** Accessors for the t type *)
 
 val get_writebuf : t -> Cstruct.t Lwt.t
@@ -38,6 +76,18 @@ val mac          : t -> Macaddr.t
     interfaces. *)
 val create : unit -> (t list) Lwt.t
 
+(** [add_vif id] is a thread that returns a new network interface
+    with its own MAC address, sharing the physical interface [id]
+    with the interfaces already plugged on it. *)
+val add_vif : id -> t Lwt.t
+
+(** [join_group if mac] makes [if] receive the frames sent to the
+    multicast address [mac]. *)
+val join_group : t -> Macaddr.t -> unit
+
+(** [leave_group if mac] undoes [join_group if mac]. *)
+val leave_group : t -> Macaddr.t -> unit
+
 (** [write if buf] outputs [buf] to interface [if]. *)
 val write : t -> Cstruct.t -> unit Lwt.t
 
@@ -45,6 +95,39 @@ val write : t -> Cstruct.t -> unit Lwt.t
     single packet. *)
 val writev : t -> Cstruct.t list -> unit Lwt.t
 
+(** [writev_batch if pkts] outputs every packet of [pkts], each given
+    as a list of buffers, to interface [if] in a single call to the
+    kernel. *)
+val writev_batch : t -> Cstruct.t list list -> unit Lwt.t
+
+(** [writev_offload if off bufs] is like [writev], but leaves the
+    work described by [off] to the hardware.  Raises
+    [Invalid_argument] if [if] does not support it, see
+    [offload_caps]. *)
+val writev_offload : t -> tx_offload -> Cstruct.t list -> unit Lwt.t
+
+(** [get_stats if] is the current value of the counters of [if]. *)
+val get_stats : t -> stats
+
+(** [offload_caps if] is the set of offloads enabled on [if]. *)
+val offload_caps : t -> offload_caps
+
 (** [listen if cb] is a thread that listens endlesses on [if], and
-    invoke the callback function as frames are received. *)
+    invoke the callback function as frames are received.  Broadcast
+    and multicast frames may be shared with other interfaces, and
+    must not be modified. *)
 val listen : t -> (Cstruct.t -> unit Lwt.t) -> unit Lwt.t
+
+(** [listen_batch if cb] is like [listen], but hands every frame
+    that is waiting on [if] to [cb] at once, in arrival order, and
+    only yields afterwards. *)
+val listen_batch : t -> (Cstruct.t array -> unit Lwt.t) -> unit Lwt.t
+
+(** [listen_frags if cb] is like [listen], but hands every frame to
+    [cb] as the list of buffers it was received in, so that large
+    frames are not copied. *)
+val listen_frags : t -> (Cstruct.t list -> unit Lwt.t) -> unit Lwt.t
+
+(** [listen_csum if cb] is like [listen], but also tells [cb] which
+    checksums of the frame were already verified by the hardware. *)
+val listen_csum : t -> (Cstruct.t -> rx_csum -> unit Lwt.t) -> unit Lwt.t
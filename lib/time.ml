@@ -25,28 +25,99 @@
 
 open Lwt
 
+(* Sleepers live in a hierarchical timing wheel.  Time is counted in ticks
+   of 1/1024 second (exact in the fixed-point float representation), and
+   each of the [levels] wheels resolves [bits] more bits of the deadline
+   tick.  A sleeper sits on the lowest level on which its deadline and the
+   current tick share all higher digits; it is cascaded one level down each
+   time the current tick reaches its slot.  Inserting and cancelling are
+   O(1) and cancelled sleepers are unlinked straight away. *)
+
 type sleep = {
-  time : float;
-  mutable canceled : bool;
+  tick : int;
   thread : unit Lwt.u;
+  mutable level : int;
+  mutable node : sleep Lwt_sequence.node option;
 }
 
-module SleepQueue =
-  Lwt_pqueue.Make (struct
-                     type t = sleep
-                     let compare { time = t1 } { time = t2 } = compare t1 t2
-                   end)
-
-let sleep_queue = ref SleepQueue.empty
-
-let new_sleeps = ref []
+let ticks_per_second = 1024.0
+let bits = 8
+let slots = 1 lsl bits
+let mask = slots - 1
+let levels = 5
+
+let tick_floor t = int_of_float (t *. ticks_per_second)
+
+let tick_ceil t =
+  let x = t *. ticks_per_second in
+  let k = int_of_float x in
+  if float_of_int k < x then k + 1 else k
+
+let time_of_tick k = float_of_int k /. ticks_per_second
+
+let wheel =
+  Array.init levels (fun _ -> Array.init slots (fun _ -> Lwt_sequence.create ()))
+
+(* Number of sleepers on each level, to skip over empty stretches. *)
+let pending = Array.make levels 0
+
+(* Sleepers that are due at the next turn of the scheduler. *)
+let ready = ref (Lwt_sequence.create ())
+
+let current = ref (tick_floor (Clock.time ()))
+
+let digit k l = (k lsr (bits * l)) land mask
+
+let insert s =
+  let c = !current in
+  if s.tick <= c then begin
+    s.level <- -1;
+    s.node <- Some (Lwt_sequence.add_r s !ready)
+  end else begin
+    let rec find l =
+      if l = levels then None
+      else if (s.tick lxor c) lsr (bits * (l + 1)) = 0 then Some l
+      else find (l + 1)
+    in
+    let l, slot =
+      match find 0 with
+      | Some l -> l, digit s.tick l
+      (* Beyond the range of the wheel: park it in the slot visited last
+         and place it again from there. *)
+      | None -> levels - 1, (digit c (levels - 1) - 1) land mask
+    in
+    s.level <- l;
+    pending.(l) <- pending.(l) + 1;
+    s.node <- Some (Lwt_sequence.add_r s wheel.(l).(slot))
+  end
+
+let remove s =
+  match s.node with
+  | None -> ()
+  | Some n ->
+    Lwt_sequence.remove n;
+    s.node <- None;
+    if s.level >= 0 then pending.(s.level) <- pending.(s.level) - 1
+
+let schedule s =
+  if s.tick <= !current then Lwt.wakeup s.thread ()
+  else insert s
+
+let rec drain l seq =
+  match Lwt_sequence.take_opt_l seq with
+  | None -> ()
+  | Some s ->
+    s.node <- None;
+    if l >= 0 then pending.(l) <- pending.(l) - 1;
+    schedule s;
+    drain l seq
 
 let sleep d =
   let (res, w) = Lwt.task () in
-  let t = if d <= 0.0 then 0.0 else Clock.time () +. d in
-  let sleeper = { time = t; canceled = false; thread = w } in
-  new_sleeps := sleeper :: !new_sleeps;
-  Lwt.on_cancel res (fun _ -> sleeper.canceled <- true);
+  let t = if d <= 0.0 then 0 else tick_ceil (Clock.time () +. d) in
+  let sleeper = { tick = t; thread = w; level = -1; node = None } in
+  insert sleeper;
+  Lwt.on_cancel res (fun _ -> remove sleeper);
   res
 
 let yield () = sleep 0.0
@@ -67,38 +138,59 @@ let timeout d = sleep d >> Lwt.fail Timeout
 
 let with_timeout d f = Lwt.pick [timeout d; Lwt.apply f ()]
 
-let in_the_past now t =
-  t = 0.0 || t <= now ()
-
-let rec restart_threads now =
-  match SleepQueue.lookup_min !sleep_queue with
-    | Some{ canceled = true } ->
-        sleep_queue := SleepQueue.remove_min !sleep_queue;
-        restart_threads now
-    | Some{ time = time; thread = thread } when in_the_past now time ->
-        sleep_queue := SleepQueue.remove_min !sleep_queue;
-        Lwt.wakeup thread ();
-        restart_threads now
-    | _ -> ()
-
-let min_timeout a b = match a, b with
-  | None, b -> b
-  | a, None -> a
-  | Some a, Some b -> Some(min a b)
-
-let rec get_next_timeout now =
-  match SleepQueue.lookup_min !sleep_queue with
-    | Some{ canceled = true } ->
-        sleep_queue := SleepQueue.remove_min !sleep_queue;
-        get_next_timeout now
-    | Some{ time = time } ->
-        Some (if time = 0.0 then 0.0 else max 0.0 (time -. (now ())))
-    | None ->
-        None
-
+let rec lowest_pending l =
+  if l = levels then None
+  else if pending.(l) > 0 then Some l
+  else lowest_pending (l + 1)
+
+let rec advance target =
+  if !current < target then begin
+    (match lowest_pending 0 with
+     | None -> current := target - 1
+     | Some l ->
+       let lowmask = (1 lsl (bits * l)) - 1 in
+       current := max !current (min (target - 1) (!current lor lowmask)));
+    incr current;
+    let c = !current in
+    let rec top l =
+      if l + 1 < levels && c land ((1 lsl (bits * (l + 1))) - 1) = 0
+      then top (l + 1) else l
+    in
+    for l = top 0 downto 1 do
+      drain l wheel.(l).(digit c l)
+    done;
+    drain 0 wheel.(0).(digit c 0);
+    advance target
+  end
+
+let restart_threads now =
+  (* Sleepers made ready from here on wait for the next turn. *)
+  let r = !ready in
+  ready := Lwt_sequence.create ();
+  drain (-1) r;
+  advance (tick_floor (now ()))
+
+(* Offset, in slots of level [l], of the first non-empty slot after the
+   current one. *)
+let rec first_slot l c j =
+  if j = slots then None
+  else if Lwt_sequence.is_empty wheel.(l).((digit c l + j) land mask) then
+    first_slot l c (j + 1)
+  else Some j
+
+(* Wake up when the current tick reaches the first occupied slot: its
+   sleepers are due then if it is on level 0, or cascaded to a lower level
+   otherwise, so looking into the slot is never needed. *)
 let select_next now =
-  sleep_queue :=
-    List.fold_left
-      (fun q e -> SleepQueue.add e q) !sleep_queue !new_sleeps;
-  new_sleeps := [];
-  get_next_timeout now
+  if not (Lwt_sequence.is_empty !ready) then Some 0.0
+  else
+    match lowest_pending 0 with
+    | None -> None
+    | Some l ->
+      let c = !current in
+      match first_slot l c 1 with
+      | None -> None
+      | Some j ->
+        let above = bits * (l + 1) in
+        let k = (c lsr above) lsl above + (digit c l + j) lsl (bits * l) in
+        Some (max 0.0 (time_of_tick k -. now ()))